@@ -17,8 +17,12 @@
     along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+
 #include <boost/io/ios_state.hpp>
 
+#include "assert.h"
+
 #include "Block.hpp"
 
 std::ostream &operator<< (std::ostream& os, const Block& rBl)
@@ -31,6 +35,32 @@ std::ostream &operator<< (std::ostream& os, const Block& rBl)
 	               << ", level: 0x" << rBl.level
 	               << ", coffset: 0x" << rBl.coffset
 	               << ", clength: 0x" << rBl.clength;
+	if (rBl.type.isFramed())
+		os << ", flength: 0x" << rBl.flength
+		   << ", frames: 0x" << rBl.frames.size();
 	return os;
 }
 
+
+Block Block::getFrame(off_t offset) const
+{
+	assert(type.isFramed());
+	assert((offset >= this->offset) && (offset < this->offset + (off_t) length));
+
+	size_t i = (offset - this->offset) / flength;
+
+	assert(i < frames.size());
+
+	Block frame(type);
+
+	frame.level = level;
+	frame.offset = this->offset + i * flength;
+	frame.coffset = coffset + frames[i];
+	frame.olength = std::min(flength, olength - i * flength);
+	frame.length = std::min(frame.olength, length - i * flength);
+	frame.clength = ((i + 1 < frames.size()) ? frames[i + 1] : clength) - frames[i];
+
+	frame.type.setFramed(false);
+
+	return frame;
+}
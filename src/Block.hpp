@@ -21,8 +21,10 @@
 #define BLOCKHPP
 
 #include <ostream>
+#include <vector>
 
 #include <boost/serialization/version.hpp>
+#include <boost/serialization/vector.hpp>
 
 #include "CompressionType.hpp"
 
@@ -38,40 +40,61 @@ class Block
 		ar & clength;
 		ar & level;
 		ar & type;
+
+		// Only framed blocks have the table of frames, layer maps
+		// without them are the same as before frames were invented.
+
+		if (type.isFramed())
+		{
+			ar & flength;
+			ar & frames;
+		}
 	}
 public:
 	Block(const Block &src) :
 		offset (src.offset), coffset (src.coffset), length (src.length),
-		olength (src.olength), clength(src.clength), level (src.level), type (src.type)
+		olength (src.olength), clength(src.clength), level (src.level), type (src.type),
+		flength (src.flength), frames (src.frames)
 		{ }
 
 	Block(off_t offset, size_t length, off_t coffset, size_t olength, size_t clength, unsigned int level, unsigned char type) :
 		offset (offset), coffset (coffset), length (length),
-		olength (olength), clength(clength), level (level), type (type)
+		olength (olength), clength(clength), level (level), type (type),
+		flength (0)
 		{ }
 
 	Block()
 	:	offset (0), coffset (0), length (0),
-		olength (0), clength (0), level (0), type (CompressionType::NONE)
+		olength (0), clength (0), level (0), type (CompressionType::NONE),
+		flength (0)
 		{ }
 
 	Block(off_t offset, size_t length)
 	:	offset (offset), coffset (0), length (length),
-		olength (length), clength (0), level (0), type(CompressionType::NONE)
+		olength (length), clength (0), level (0), type(CompressionType::NONE),
+		flength (0)
 		{ }
 
 	Block(off_t offset, size_t length, unsigned int level)
 	:	offset (offset), coffset (0), length (length),
-		olength (length), clength (0), level (level), type(CompressionType::NONE)
+		olength (length), clength (0), level (level), type(CompressionType::NONE),
+		flength (0)
 		{ }
 
 	Block(CompressionType type)
 	:	offset (0), coffset (0), length (0),
-		olength (0), clength (0), level (0), type (type)
+		olength (0), clength (0), level (0), type (type),
+		flength (0)
 		{ }
 
 	~Block() {};
 
+	/**
+	 * Returns the frame of a framed block that covers the `offset`
+	 * as a standalone (not framed) block.
+	 */
+	Block getFrame(off_t offset) const;
+
 	friend std::ostream &operator<< (std::ostream& os, const Block& rBl);
 
 	off_t offset, coffset;
@@ -81,6 +104,15 @@ public:
 	unsigned int level;
 
 	CompressionType type;
+
+	// Framed blocks are compressed as a sequence of independent
+	// frames of `flength` bytes (the last one may be shorter),
+	// `frames` holds the compressed offsets of the frames relative
+	// to `coffset`. A frame can be decompressed without decompressing
+	// the data before it.
+	//
+	size_t flength;
+	std::vector<size_t> frames;
 };
 
 BOOST_CLASS_VERSION(Block, 0)
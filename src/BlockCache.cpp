@@ -0,0 +1,215 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+
+#include "rlog/rlog.h"
+#include "assert.h"
+
+#include "BlockCache.hpp"
+#include "Lock.hpp"
+
+// Programs may set the limit according to the user's wish,
+// the cache is disabled by default.
+
+BlockCache g_BlockCache;
+
+BlockCache::Entry::Entry(unsigned long ticket) :
+	buf (NULL),
+	length (0),
+	ticket (ticket)
+{
+}
+
+void BlockCache::Entry::set(const char *buf, size_t length)
+{
+	this->buf = new char[length];
+	this->length = length;
+	this->ticket = 0;
+	memcpy(this->buf, buf, length);
+}
+
+BlockCache::Entry::~Entry()
+{
+	delete[] buf;
+}
+
+BlockCache::BlockCache() :
+	m_size (0),
+	m_limit (0),
+	m_hits (0),
+	m_misses (0),
+	m_ticket (0)
+{
+}
+
+BlockCache::~BlockCache()
+{
+	shrink(0);
+
+	// Only reservations of blocks may remain.
+
+	while (!m_map.empty())
+		erase(m_map.begin());
+}
+
+void BlockCache::erase(con_t::iterator it)
+{
+	Entry *entry = it->second;
+
+	// Reserved blocks are not in the LRU list yet.
+
+	if (entry->ticket == 0)
+	{
+		m_size -= entry->length;
+		m_lru.erase(entry->lru);
+	}
+	m_map.erase(it);
+
+	delete entry;
+}
+
+void BlockCache::shrink(size_t limit)
+{
+	while (m_size > limit)
+	{
+		assert(!m_lru.empty());
+
+		erase(m_map.find(m_lru.back()));
+	}
+}
+
+void BlockCache::setLimit(size_t limit)
+{
+	Lock lock(m_mutex);
+
+	m_limit = limit;
+	shrink(m_limit);
+}
+
+bool BlockCache::get(ino_t inode, off_t coffset, off_t offset, size_t size, char *buf)
+{
+	Lock lock(m_mutex);
+
+	con_t::iterator it = m_map.find(key_t(inode, coffset));
+
+	if ((it == m_map.end()) || (it->second->ticket != 0) ||
+	    ((off_t) it->second->length < offset + (off_t) size))
+	{
+		m_misses++;
+		return false;
+	}
+	m_hits++;
+
+	Entry *entry = it->second;
+
+	memcpy(buf, entry->buf + offset, size);
+
+	// Move the block to the front, it's the most recently used one now.
+
+	m_lru.splice(m_lru.begin(), m_lru, entry->lru);
+
+	return true;
+}
+
+unsigned long BlockCache::reserve(ino_t inode, off_t coffset)
+{
+	Lock lock(m_mutex);
+
+	key_t key(inode, coffset);
+
+	if (m_map.find(key) != m_map.end())
+		return 0;
+
+	// Zero is not a valid ticket.
+
+	if (++m_ticket == 0)
+		++m_ticket;
+
+	m_map[key] = new Entry(m_ticket);
+
+	return m_ticket;
+}
+
+void BlockCache::put(ino_t inode, off_t coffset, const char *buf, size_t length, unsigned long ticket)
+{
+	Lock lock(m_mutex);
+
+	key_t key(inode, coffset);
+
+	con_t::iterator it = m_map.find(key);
+
+	if (ticket != 0)
+	{
+		// The reservation is gone if the block has been
+		// invalidated, the data in the buf may be outdated.
+
+		if ((it == m_map.end()) || (it->second->ticket != ticket))
+			return;
+	}
+	if (it != m_map.end())
+		erase(it);
+
+	if (length > m_limit)
+		return;
+
+	shrink(m_limit - length);
+
+	Entry *entry = new Entry(0);
+
+	entry->set(buf, length);
+
+	m_lru.push_front(key);
+	entry->lru = m_lru.begin();
+
+	m_map[key] = entry;
+	m_size += length;
+}
+
+void BlockCache::cancel(ino_t inode, off_t coffset, unsigned long ticket)
+{
+	Lock lock(m_mutex);
+
+	con_t::iterator it = m_map.find(key_t(inode, coffset));
+
+	if ((it != m_map.end()) && (it->second->ticket == ticket))
+		erase(it);
+}
+
+void BlockCache::invalidate(ino_t inode, off_t coffset)
+{
+	Lock lock(m_mutex);
+
+	con_t::iterator it = m_map.lower_bound(key_t(inode, coffset));
+
+	while ((it != m_map.end()) && (it->first.first == inode))
+	{
+		erase(it++);
+	}
+}
+
+std::ostream &operator<<(std::ostream &os, BlockCache &rCache)
+{
+	Lock lock(rCache.m_mutex);
+
+	os << "cache size: " << rCache.m_size
+	   << ", limit: " << rCache.m_limit
+	   << ", blocks: " << rCache.m_map.size()
+	   << ", hits: " << rCache.m_hits
+	   << ", misses: " << rCache.m_misses;
+	return os;
+}
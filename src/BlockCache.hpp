@@ -0,0 +1,137 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLOCKCACHE_HPP
+#define BLOCKCACHE_HPP
+
+#include <sys/types.h>
+
+#include <map>
+#include <list>
+#include <utility>
+#include <iostream>
+
+#include "Mutex.hpp"
+
+/**
+ * Cache of decompressed Blocks shared by all files. Blocks are identified
+ * by the inode number of the lower file and by the offset of the compressed
+ * data in that file (Block::coffset). Least recently used blocks are
+ * dropped when the total size of the cached data exceeds the limit.
+ */
+class BlockCache
+{
+	typedef std::pair<ino_t, off_t> key_t;
+	typedef std::list<key_t> lru_t;
+
+	struct Entry
+	{
+		Entry(unsigned long ticket);
+		~Entry();
+
+		void set(const char *buf, size_t length);
+
+		char		*buf;
+		size_t		 length;
+		lru_t::iterator	 lru;
+
+		// Nonzero if the block is being decompressed
+		// in the background.
+		//
+		unsigned long	 ticket;
+	};
+
+	typedef std::map<key_t, Entry *> con_t;
+
+	con_t	m_map;
+
+	// Most recently used Block is at the front.
+	//
+	lru_t	m_lru;
+
+	size_t	m_size;
+	size_t	m_limit;
+
+	unsigned long long m_hits;
+	unsigned long long m_misses;
+
+	unsigned long m_ticket;
+
+	Mutex	m_mutex;
+
+	void erase(con_t::iterator it);
+	void shrink(size_t limit);
+
+	BlockCache(const BlockCache &);			// No copy constructor
+	BlockCache& operator=(const BlockCache &);	// No assign operator
+public:
+	BlockCache();
+	~BlockCache();
+
+	/**
+	 * Set the maximal number of bytes of decompressed data
+	 * kept in the cache. Zero disables the cache.
+	 */
+	void setLimit(size_t limit);
+
+	bool isEnabled() const { return m_limit > 0; }
+
+	/**
+	 * Returns true if a decompressed block is worth putting into
+	 * the cache.
+	 */
+	bool isCacheable(size_t length) const { return length <= m_limit; }
+
+	/**
+	 * Copy `size` bytes starting at `offset` (relative to the start of
+	 * the decompressed block) to the `buf`.
+	 *
+	 * @return true if the block is in the cache and is long enough.
+	 */
+	bool get(ino_t inode, off_t coffset, off_t offset, size_t size, char *buf);
+
+	/**
+	 * Reserve a place for a block that is going to be decompressed
+	 * in the background.
+	 *
+	 * @return ticket to be passed to the put() or cancel(), zero
+	 *         if the block is already cached or reserved.
+	 */
+	unsigned long reserve(ino_t inode, off_t coffset);
+
+	/**
+	 * Store `length` bytes of the decompressed block. If the
+	 * `ticket` is nonzero the block is stored only if the reservation
+	 * has not been invalidated in the meantime.
+	 */
+	void put(ino_t inode, off_t coffset, const char *buf, size_t length, unsigned long ticket = 0);
+
+	/**
+	 * Drop the reservation made by reserve().
+	 */
+	void cancel(ino_t inode, off_t coffset, unsigned long ticket);
+
+	/**
+	 * Drop all blocks of the file `inode` that are stored on
+	 * the `coffset` or on higher offsets.
+	 */
+	void invalidate(ino_t inode, off_t coffset = 0);
+
+	friend std::ostream &operator<<(std::ostream &os, BlockCache &rCache);
+};
+
+#endif
@@ -18,10 +18,13 @@
 */
 
 #include <errno.h>
+#include <cstring>
 #include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <map>
+#include <vector>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -36,7 +39,6 @@
 
 #include <boost/scoped_array.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
-#include <boost/iostreams/filter/bytescounter.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/device/nonclosable_file_descriptor.hpp>
 #include <boost/iostreams/slice.hpp>
@@ -53,6 +55,11 @@
 #include "FileRememberTimes.hpp"
 #include "FileRememberXattrs.hpp"
 #include "FileManager.hpp"
+#include "BlockCache.hpp"
+#include "ThreadPool.hpp"
+#include "Defragmenter.hpp"
+#include "Condition.hpp"
+#include "Lock.hpp"
 
 #include "CompressedMagic.hpp"
 
@@ -62,6 +69,230 @@ namespace se = boost::serialization;
 extern CompressedMagic	 g_CompressedMagic;
 extern CompressionType	 g_CompressionType;
 extern FileManager	*g_FileManager;
+extern BlockCache	 g_BlockCache;
+extern ThreadPool	 g_ThreadPool;
+extern Defragmenter	 g_Defragmenter;
+extern unsigned int	 g_BufferedMemorySize;
+extern bool		 g_AlignBlocks;
+
+// Number of blocks decompressed in the background when
+// a file is read sequentially. Zero disables the read-ahead.
+
+unsigned int g_ReadAhead = 0;
+
+// Length of independently compressed frames of newly written blocks.
+// Zero disables framing, blocks are compressed as a single stream.
+
+unsigned int g_FrameLength = 0;
+
+// A file is defragmented when its lower file is longer than
+// g_DefragmentMinimum and longer than its uncompressed length
+// increased by g_DefragmentRatio percent. Zero ratio disables
+// the defragmentation.
+
+unsigned int g_DefragmentRatio = 20;
+unsigned int g_DefragmentMinimum = 4096;
+
+// Differs from the MappedIndex::Magic only in the identification
+// of the record.
+
+const char Compress::RecordMagic[8] = { '\037', '\135', '\211', 'F', 'C', 'J', 'R', '\001' };
+
+/**
+ * Create a new Block of the `size` bytes on the `offset`
+ * compressed with the default compression type.
+ */
+static Block newBlock(off_t offset, size_t size)
+{
+	Block bl(g_CompressionType);
+
+	bl.offset = offset;
+	bl.length = size;
+	bl.olength = size;
+
+	// Framing a block that fits into a frame makes no sense.
+
+	if ((g_FrameLength > 0) && (size > g_FrameLength))
+	{
+		bl.type.setFramed(true);
+		bl.flength = g_FrameLength;
+	}
+	return bl;
+}
+
+/**
+ * Compress `block.length` bytes of the `buf` to the `data` and
+ * set `block.clength`. Framed blocks are compressed frame by frame,
+ * the compressed offsets of the frames are stored to `block.frames`.
+ */
+static void compressBlock(Block& block, const char *buf, std::vector<char>& data)
+{
+	size_t done = 0;
+
+	data.clear();
+	block.frames.clear();
+	do {
+		size_t size = block.length - done;
+
+		if (block.type.isFramed())
+		{
+			size = min(size, block.flength);
+			block.frames.push_back(data.size());
+		}
+		block.type.compress(buf + done, size, data);
+		done += size;
+	} while (done < block.length);
+
+	block.clength = data.size();
+}
+
+/**
+ * Decompress first `length` bytes of the `block` stored
+ * in the file `fd` to the `buf`.
+ *
+ * Doesn't change the file offset of the `fd`, it may be
+ * shared by multiple threads.
+ */
+static void decompressBlock(int fd, const Block& block, char *buf, off_t length)
+{
+	boost::scoped_array<char> cbuf(new char[block.clength]);
+
+	ssize_t r = ::pread(fd, cbuf.get(), block.clength, block.coffset);
+	if (r != (ssize_t) block.clength)
+		throw BOOST_IOSTREAMS_FAILURE("short read of the compressed block");
+
+	block.type.decompress(cbuf.get(), block.clength, buf, length, block.olength);
+}
+
+/**
+ * Decompresses a block to the g_BlockCache on background.
+ */
+class ReadAheadJob : public ThreadPool::Job
+{
+	int		 m_fd;
+	ino_t		 m_inode;
+	Block		 m_block;
+	unsigned long	 m_ticket;
+public:
+	/**
+	 * @param fd - duplicated file descriptor, closed when the job is deleted
+	 * @param ticket - reservation of the block in the g_BlockCache
+	 */
+	ReadAheadJob(int fd, ino_t inode, const Block& block, unsigned long ticket) :
+		m_fd (fd),
+		m_inode (inode),
+		m_block (block),
+		m_ticket (ticket)
+	{ }
+
+	~ReadAheadJob()
+	{
+		if (m_ticket != 0)
+			g_BlockCache.cancel(m_inode, m_block.coffset, m_ticket);
+		::close(m_fd);
+	}
+
+	void run()
+	{
+		try {
+			boost::scoped_array<char> buf(new char[m_block.length]);
+
+			decompressBlock(m_fd, m_block, buf.get(), m_block.length);
+
+			g_BlockCache.put(m_inode, m_block.coffset, buf.get(), m_block.length, m_ticket);
+			m_ticket = 0;
+		}
+		catch (exception& e)
+		{
+			rDebug("%s: Block read failed: coffset:%lx, exception: %s",
+				__PRETTY_FUNCTION__, (long int) m_block.coffset, e.what());
+		}
+	}
+};
+
+/**
+ * Part of a buffer compressed to the memory by the CompressJob.
+ */
+struct CompressedChunk
+{
+	const char		*buf;
+	Block			 block;
+	std::vector<char>	 data;
+
+	// True if the data contains the whole compressed buf.
+	//
+	bool			 done;
+};
+
+/**
+ * Set of CompressJobs the writer waits for.
+ */
+class CompressBatch
+{
+	unsigned int	 m_pending;
+	Mutex		 m_mutex;
+	Condition	 m_cond;
+public:
+	CompressBatch() : m_pending (0) { }
+
+	void add()
+	{
+		Lock lock(m_mutex);
+		m_pending++;
+	}
+
+	void finish()
+	{
+		Lock lock(m_mutex);
+		if (--m_pending == 0)
+			m_cond.Signal();
+	}
+
+	void wait()
+	{
+		Lock lock(m_mutex);
+		while (m_pending > 0)
+			m_cond.Wait(m_mutex);
+	}
+};
+
+/**
+ * Compresses a CompressedChunk on background.
+ */
+class CompressJob : public ThreadPool::Job
+{
+	CompressedChunk	&m_chunk;
+	CompressBatch	&m_batch;
+public:
+	CompressJob(CompressedChunk& chunk, CompressBatch& batch) :
+		m_chunk (chunk),
+		m_batch (batch)
+	{
+		m_batch.add();
+	}
+
+	// The job is deleted even if it has not been run
+	// (ThreadPool has been stopped), the chunk is then
+	// left not done.
+
+	~CompressJob()
+	{
+		m_batch.finish();
+	}
+
+	void run()
+	{
+		try {
+			compressBlock(m_chunk.block, m_chunk.buf, m_chunk.data);
+			m_chunk.done = true;
+		}
+		catch (exception& e)
+		{
+			rDebug("%s: Compression failed, exception: %s",
+				__PRETTY_FUNCTION__, e.what());
+		}
+	}
+};
 
 std::ostream &operator<<(std::ostream &os, const Compress &rC)
 {
@@ -75,7 +306,12 @@ std::ostream &operator<<(std::ostream &os, const Compress &rC)
 }
 
 Compress::Compress(const struct stat *st, const char *name) :
-	Parent (st, name)
+	Parent (st, name),
+	m_JournalLength (0),
+	m_JournalBlocks (0),
+	m_LastWrite (0),
+	m_DefragmentQueued (false),
+	m_ReadAheadOffset (0)
 {
 	if (st->st_size == 0)
 	{
@@ -145,6 +381,10 @@ int Compress::unlink(const char *name)
 	{
 		m_lm.Truncate(0);	// Free allocated memory
 		m_RawFileSize = 0;
+
+		// The inode number may be used by another file soon.
+
+		g_BlockCache.invalidate(m_inode);
 	}
 
 	return Parent::unlink(name);
@@ -177,15 +417,23 @@ int Compress::truncate(const char *name, off_t size)
 	//
 	if (size == 0)
 	{
-		r = ::ftruncate(m_fd, FileHeader::MaxSize);
-		if (r == -1)
-			rWarning("Compress::truncate('%s', %ld) failed!",
-			          name, (long int) size);
-
-		m_RawFileSize = FileHeader::MaxSize;
+		// Commit the empty file first, a crash before the truncation
+		// leaves only unused data behind the file header.
 
 		m_fh.size = size;
+		m_fh.index = 0;
 		m_lm.Truncate(size);
+
+		r = store();
+		if (r == 0)
+		{
+			r = ::ftruncate(m_fd, FileHeader::MaxSize);
+			if (r == -1)
+				rWarning("Compress::truncate('%s', %ld) failed!",
+				          name, (long int) size);
+
+			m_RawFileSize = FileHeader::MaxSize;
+		}
 	}
 	else
 	{
@@ -201,10 +449,10 @@ int Compress::truncate(const char *name, off_t size)
 		m_lm.Truncate(size);
 
 		if (defragment)
-			DefragmentFast();
-	}
+			scheduleDefragment();
 
-	r = store();
+		r = store();
+	}
 
 	if (openedHere)
 	{
@@ -214,14 +462,14 @@ int Compress::truncate(const char *name, off_t size)
 	return r;
 }
 
-int Compress::getattr(const char *name, struct stat *st)
+int Compress::getattr(const char *name, struct stat *st, bool known)
 {
 	int r;
 
 	rDebug("%s name: %s, m_IsCompressed: %d, m_fh.size: 0x%lx",
 	        __FUNCTION__, name, m_IsCompressed, (long int) m_fh.size);
 
-	r = Parent::getattr(name, st);
+	r = Parent::getattr(name, st, known);
 
 	if (m_IsCompressed)
 	{
@@ -289,63 +537,43 @@ off_t Compress::writeCompressed(LayerMap& lm, off_t offset, off_t coffset, const
 	rDebug("offset: 0x%lx, coffset: 0x%lx, size: 0x%lx",
 	       (long int) offset, (long int) coffset, (long int) size);
 
-	Block *bl = NULL;
+	// Append a new Block to the file.
 
-	try {
-		// Append a new Block to the file.
+	Block bl = newBlock(offset, size);
+	bl.coffset = coffset;
 
-		bl = new Block(g_CompressionType);
+	try {
+		// The Block is appended behind the index, the index stays
+		// valid until store() commits a new one. A crash before
+		// that loses only the data written since the last store.
 
-		bl->offset = offset;
-		bl->coffset = coffset;
-		bl->length = size;
-		bl->olength = size;
+		assert(bl.coffset == rawFileSize);
 
-		// Truncate the file to m_RawFileSize.
-		//
-		// This efectively removes layer map from the file, so if
-		// anything wrong happens until store() is called we lost the
-		// file!
-		//
-		// We have to do that until I find a way how to get length of
-		// the compressed block that is written by io::write()...
-		//
-		// OK, I now know how to get length of the compressed block,
-		// but I don't know anymore how to use it to avoid the truncation.
+		// Blocks of this file that were stored on the overwritten
+		// part are not valid anymore.
 
-		assert(bl->coffset == rawFileSize);
-		::ftruncate(fd, bl->coffset);
+		if (fd == m_fd)
+			g_BlockCache.invalidate(m_inode, bl.coffset);
 
 		// Compress and write block to the file.
 
-		io::nonclosable_file_descriptor file(fd);
-		file.seek(bl->coffset, ios_base::beg);
-		io::bytescounter length;
-		{
-			io::filtering_ostream out;
-
-			bl->type.push(out);
-			out.push(boost::ref(length));
-			out.push(file);
+		std::vector<char> data;
 
-			io::write(out, buf, bl->length);
+		compressBlock(bl, buf, data);
 
-			// Destroying the object 'out' causes all filters to flush.
-		}
+		if (!FileUtils::writeAll(fd, &data[0], bl.clength, bl.coffset))
+			throw BOOST_IOSTREAMS_FAILURE(strerror(errno));
 
-		bl->clength = length.bytes();
-		coffset = bl->coffset + bl->clength;
+		coffset = bl.coffset + bl.clength;
 	}
 	catch (exception& e)
 	{
 		rError("%s: Failed to add a new Block to the file, offset: %lx, coffset: %lx, exception: %s",
-			__PRETTY_FUNCTION__, bl->offset, bl->coffset, e.what());
+			__PRETTY_FUNCTION__, bl.offset, bl.coffset, e.what());
 
-		delete bl;
 		return -1;
 	}
 	
-	assert(bl != NULL);
 	lm.Put(bl);
 
 	rDebug("length: 0x%lx", (long int) coffset);
@@ -353,6 +581,138 @@ off_t Compress::writeCompressed(LayerMap& lm, off_t offset, off_t coffset, const
 	return coffset;
 }
 
+off_t Compress::appendCompressed(Block& bl, const char *cbuf)
+{
+	bl.coffset = m_RawFileSize;
+
+	rDebug("offset: 0x%lx, coffset: 0x%lx, size: 0x%lx, csize: 0x%lx",
+	       (long int) bl.offset, (long int) bl.coffset, (long int) bl.length, (long int) bl.clength);
+
+	// Append behind the index the same way as writeCompressed() does.
+
+	g_BlockCache.invalidate(m_inode, m_RawFileSize);
+
+	if (!FileUtils::writeAll(m_fd, cbuf, bl.clength, bl.coffset))
+	{
+		rError("%s: Failed to add a new Block to the file, offset: %lx, coffset: %lx, errno: %d",
+			__PRETTY_FUNCTION__, (long int) bl.offset, (long int) bl.coffset, errno);
+
+		return -1;
+	}
+
+	m_lm.Put(bl);
+
+	return bl.coffset + bl.clength;
+}
+
+off_t Compress::writeParallel(off_t offset, const char *buf, size_t size)
+{
+	std::vector<CompressedChunk> chunks((size + g_BufferedMemorySize - 1) / g_BufferedMemorySize);
+
+	CompressBatch batch;
+
+	for (unsigned int i = 0; i < chunks.size(); ++i)
+	{
+		size_t done = (size_t) i * g_BufferedMemorySize;
+
+		chunks[i].buf = buf + done;
+		chunks[i].block = newBlock(offset + done, min((size_t) g_BufferedMemorySize, size - done));
+		chunks[i].done = false;
+
+		g_ThreadPool.push(new CompressJob(chunks[i], batch));
+	}
+	batch.wait();
+
+	// Blocks are appended in the order of their offsets. A chunk
+	// that failed to compress on background is compressed again
+	// here to get the error reported the usual way.
+
+	off_t rawFileSize = m_RawFileSize;
+
+	for (unsigned int i = 0; i < chunks.size(); ++i)
+	{
+		CompressedChunk &chunk = chunks[i];
+
+		if (rawFileSize == -1)
+		{
+			// An error happened, skip remaining blocks.
+
+			continue;
+		}
+
+		if (chunk.done)
+		{
+			rawFileSize = appendCompressed(chunk.block, &chunk.data[0]);
+		}
+		else
+		{
+			rawFileSize = writeCompressed(m_lm, chunk.block.offset, m_RawFileSize,
+			                              chunk.buf, chunk.block.length, m_fd, m_RawFileSize);
+		}
+
+		if (rawFileSize != -1)
+			m_RawFileSize = rawFileSize;
+	}
+	return rawFileSize;
+}
+
+int Compress::writeData(off_t offset, const char *buf, size_t size)
+{
+	off_t rawFileSize;
+
+	// Big buffers are split into more blocks that are
+	// compressed in parallel.
+
+	if ((g_ThreadPool.size() > 1) && (size > g_BufferedMemorySize))
+		rawFileSize = writeParallel(offset, buf, size);
+	else
+		rawFileSize = writeCompressed(m_lm, offset, m_RawFileSize, buf, size, m_fd, m_RawFileSize);
+	if (rawFileSize == -1)
+		return -1;
+	m_RawFileSize = rawFileSize;
+
+	return 0;
+}
+
+void Compress::putHole(off_t offset, size_t length)
+{
+	// The hole only has to hide older data, there is
+	// none behind the end of the file.
+
+	if (offset >= m_fh.size)
+		return;
+
+	Block bl(offset, min(length, (size_t) (m_fh.size - offset)));
+
+	bl.type.setType(CompressionType::NONE | CompressionType::Zero);
+
+	rDebug("offset: 0x%lx, length: 0x%lx", (long int) bl.offset, (long int) bl.length);
+
+	m_lm.Put(bl);
+}
+
+int Compress::writeSparse(off_t offset, const char *buf, size_t size)
+{
+	size_t	 data = 0;	// Start of the data not written yet.
+	size_t	 start;
+	size_t	 length;
+
+	while ((length = FileUtils::findHole(buf + data, size - data, offset + data, HoleMinimum, start)) > 0)
+	{
+		if ((start > 0) && (writeData(offset + data, buf + data, start) == -1))
+			return -1;
+
+		putHole(offset + data + start, length);
+
+		data += start + length;
+	}
+
+	if ((size > data) && (writeData(offset + data, buf + data, size - data) == -1))
+		return -1;
+
+	return 0;
+}
+
 ssize_t Compress::write(const char *buf, size_t size, off_t offset)
 {
 	// Spurious call to write when file has not been opened
@@ -389,32 +749,47 @@ ssize_t Compress::write(const char *buf, size_t size, off_t offset)
 	}
 	else
 	{
+		m_LastWrite = time(NULL);
+
 		// If we write data containing only zeros to the end of the file,
 		// we can just increase size of the file. No need to really
-		// compress and write buffer of zeros...
+		// compress and write buffer of zeros... The same holds for
+		// the zeros the data ends with.
+
+		off_t	 end = offset + size;
+		size_t	 length = size;
+
+		if (end > m_fh.size)
+		{
+			size_t zeros = FileUtils::zeroSuffix(buf, size);
+
+			length -= min(zeros, (size_t) (end - max(offset, m_fh.size)));
+
+			// Aligned blocks (see g_AlignBlocks) are stored whole
+			// unless there are only zeros to store.
 
-		if ((m_fh.size == offset) && FileUtils::isZeroOnly(buf, size))
+			if (g_AlignBlocks && (length > 0))
+				length = size;
+		}
+
+		if (length == 0)
 		{
 			assert(size > 0);
-			m_fh.size = offset + size;
+			m_fh.size = end;
 		}
 		else
 		{
-			off_t rawFileSize = writeCompressed(m_lm, offset, m_RawFileSize, buf, size, m_fd, m_RawFileSize);
-			if (rawFileSize == -1)
+			// Holes would split the aligned blocks as well.
+
+			int r = g_AlignBlocks ? writeData(offset, buf, length) :
+			                        writeSparse(offset, buf, length);
+			if (r == -1)
 				return -1;
-			m_RawFileSize = rawFileSize;
 
 			assert(size > 0);
-			m_fh.size = max(m_fh.size, (off_t) (offset + size));
+			m_fh.size = max(m_fh.size, end);
 
-			// Defragment the file only if raw file size if bigger than 4096 bytes
-			// and raw file size is about 20% bigger than it would be uncompressed.
-
-			if (m_RawFileSize > 4096 && m_RawFileSize > m_fh.size + ((m_fh.size * 2) / 10))
-			{
-				DefragmentFast();
-			}
+			scheduleDefragment();
 		}
 
 		return size;
@@ -429,14 +804,35 @@ off_t Compress::readBlock(int fd, const Block& block, off_t size, off_t len, off
 {
 	off_t r;
 
-	io::nonclosable_file_descriptor file(fd);
-	file.seek(block.coffset, ios_base::beg);
+	// Blocks of zeros have no data.
 
-	io::filtering_istream in;
-	block.type.push(in);
-	in.push(io::slice(file, 0 /* already seeked and no seek after */, block.clength));
+	if (block.type.isZero())
+	{
+		r = min((off_t)(size), len);
+
+		memset(buf, 0, r);
+		return r;
+	}
+
+	// Decompress only the frames of a framed block that cover
+	// the requested range. Every frame is handled as a standalone
+	// block (it is cached separately as well).
+
+	if (block.type.isFramed())
+	{
+		off_t done = 0;
+
+		r = min((off_t)(size), len);
+
+		while (done < r)
+		{
+			Block frame = block.getFrame(offset + done);
 
-	boost::scoped_array<char> buf_tmp(new char[block.length]);
+			done += readBlock(fd, frame, r - done, frame.offset + frame.length - (offset + done),
+			                  offset + done, buf + done);
+		}
+		return r;
+	}
 
 	// Optimization: read only as much bytes as necessary.
 
@@ -447,9 +843,33 @@ off_t Compress::readBlock(int fd, const Block& block, off_t size, off_t len, off
 	assert(block.length >= 0);
 	assert(must_read <= (off_t) block.length);
 
-	io::read(in, buf_tmp.get(), must_read);
+	// Blocks of the file we are working on may be already
+	// decompressed in the cache.
+
+	bool cache = (fd == m_fd) && g_BlockCache.isEnabled();
+
+	if (cache)
+	{
+		if (g_BlockCache.get(m_inode, block.coffset, not_needed, r, buf))
+			return r;
+
+		// Decompress the whole block to make the next
+		// read of the block fast.
+
+		if (g_BlockCache.isCacheable(block.length))
+			must_read = block.length;
+		else
+			cache = false;
+	}
+
+	boost::scoped_array<char> buf_tmp(new char[must_read]);
+
+	decompressBlock(fd, block, buf_tmp.get(), must_read);
 	memcpy(buf, buf_tmp.get() + not_needed, r);
 
+	if (cache)
+		g_BlockCache.put(m_inode, block.coffset, buf_tmp.get(), must_read);
+
 	return r;
 }
 
@@ -474,6 +894,9 @@ ssize_t Compress::readCompressed(char *buf, size_t size, off_t offset, int fd) c
 	{
 		if (!m_lm.Get(offset, block, len))
 		{
+			if (errno == EIO)
+				return -1;
+
 			// Block not found. There also is no block on a upper
 			// offset.
 			//
@@ -527,60 +950,213 @@ ssize_t Compress::readCompressed(char *buf, size_t size, off_t offset, int fd) c
 	return osize - size;
 }
 
-ssize_t Compress::read(char *buf, size_t size, off_t offset) const
+/**
+ * Same as the LayerMap::Get() but it returns the frame that
+ * covers the offset if the block is framed.
+ */
+static bool getBlockOrFrame(const LayerMap& lm, off_t offset, Block& block, off_t& len)
 {
-	assert (m_fd != -1);
-	assert (size >= 0);
+	if (!lm.Get(offset, block, len))
+		return false;
 
-	rDebug("Compress::read size: 0x%lx, offset: 0x%lx",
-	       (long int) size, (long int) offset);
-
-	if (m_IsCompressed == false)
+	if ((len > 0) && block.type.isFramed())
 	{
-		return pread(m_fd, buf, size, offset);
-	}
-	else
-	{
-		return readCompressed(buf, size, offset, m_fd);
+		block = block.getFrame(offset);
+		len = min(len, block.offset + (off_t) block.length - offset);
 	}
+	return true;
 }
 
-void Compress::restoreFileHeader(const char *name)
+void Compress::readAhead(off_t offset) const
 {
-	ifstream file(name);
-	io::filtering_istream in;
-	in.push(file);
-	eos::portable_iarchive pba(in);
-	pba >> m_fh;
-}
+	Block	 block;
+	off_t	 len;
 
-/* m_fh must be correct. m_length may be changed. */
-void Compress::restoreLayerMap()
-{
-	rDebug("%s: fd: %d", __PRETTY_FUNCTION__, m_fd);
+	// Skip the block (or the frame) that has been just read.
 
-	io::nonclosable_file_descriptor file(m_fd);
-	file.seek(m_fh.index, ios_base::beg);
+	if (!getBlockOrFrame(m_lm, offset, block, len))
+		return;
+	offset += len;
 
-	io::filtering_istream in;
-	m_fh.type.push(in);
-	in.push(file);
+	for (unsigned int i = 0; (i < g_ReadAhead) && (offset < m_fh.size); )
+	{
+		if (!getBlockOrFrame(m_lm, offset, block, len))
+			break;
 
-	eos::portable_iarchive pba(in);
-	pba >> m_lm;
+		if (len == 0)
+		{
+			// Skip the gap.
 
-	// Optimization on size. Overwrite the index during
-	// next write if the index was stared on the end of the file.
+			offset = block.offset;
+			continue;
+		}
+		offset += len;
 
-	if (file.seek(0, ios_base::cur) == file.seek(0, ios_base::end))
-		m_RawFileSize = m_fh.index;
-}
+		if (block.type.isZero() || !g_BlockCache.isCacheable(block.length))
+			continue;
+		++i;
 
-void Compress::storeFileHeader() const
-{
-	rDebug("%s: m_fd: %d", __PRETTY_FUNCTION__, m_fd);
+		unsigned long ticket = g_BlockCache.reserve(m_inode, block.coffset);
+		if (ticket == 0)
+		{
+			// Already cached or being decompressed.
 
-	io::nonclosable_file_descriptor file(m_fd);
+			continue;
+		}
+
+		// Job uses own file descriptor, the file may be closed
+		// before the job is run.
+
+		int fd = ::dup(m_fd);
+		if (fd == -1)
+		{
+			g_BlockCache.cancel(m_inode, block.coffset, ticket);
+			break;
+		}
+		g_ThreadPool.push(new ReadAheadJob(fd, m_inode, block, ticket));
+	}
+}
+
+ssize_t Compress::read(char *buf, size_t size, off_t offset) const
+{
+	assert (m_fd != -1);
+	assert (size >= 0);
+
+	rDebug("Compress::read size: 0x%lx, offset: 0x%lx",
+	       (long int) size, (long int) offset);
+
+	if (m_IsCompressed == false)
+	{
+		return pread(m_fd, buf, size, offset);
+	}
+	else
+	{
+		ssize_t r = readCompressed(buf, size, offset, m_fd);
+		if (r <= 0)
+			return r;
+
+		bool sequential;
+		{
+			::Lock lock(m_ReadAheadMutex);
+
+			sequential = (offset == m_ReadAheadOffset);
+			m_ReadAheadOffset = offset + r;
+		}
+
+		// Decompress following blocks in the background
+		// if the file is read sequentially.
+
+		if (sequential &&
+		    (g_ReadAhead > 0) && g_ThreadPool.isRunning() && g_BlockCache.isEnabled())
+		{
+			readAhead(offset + r - 1);
+		}
+
+		return r;
+	}
+}
+
+void Compress::restoreFileHeader(const char *name)
+{
+	ifstream file(name);
+	io::filtering_istream in;
+	in.push(file);
+	eos::portable_iarchive pba(in);
+	pba >> m_fh;
+}
+
+/* m_fh must be correct. */
+void Compress::restoreLayerMap()
+{
+	rDebug("%s: fd: %d", __PRETTY_FUNCTION__, m_fd);
+
+	// The index is a journal. The file header points to the last
+	// record, every record points to the previous one and the first
+	// record holds the whole layer map. Records are loaded from the
+	// last one and replayed in the order they were stored. The first
+	// record is usually a MappedIndex that is used in place.
+
+	vector<LayerMap> journal;
+	off_t index = m_fh.index;
+
+	bool bounded = restoreLayerMap(index, m_lm);
+
+	m_JournalBlocks = 0;
+
+	while (m_lm.previous() != 0)
+	{
+		// Records are only appended, a link to a following
+		// record means a broken index.
+
+		if (m_lm.previous() >= index)
+			throw std::ios_base::failure("invalid index journal");
+
+		index = m_lm.previous();
+		m_JournalBlocks += m_lm.size();
+
+		journal.push_back(m_lm);
+		bounded = restoreLayerMap(index, m_lm);
+	}
+	m_JournalLength = journal.size();
+
+	// Nothing may be appended behind a record that extends to the
+	// end of the file, the next store replaces it by a whole map.
+
+	if (!bounded)
+		m_JournalLength = LayerMap::MaxJournalLength;
+
+	for (vector<LayerMap>::reverse_iterator it = journal.rbegin(); it != journal.rend(); ++it)
+		m_lm.Apply(*it);
+}
+
+bool Compress::restoreLayerMap(off_t index, LayerMap& lm)
+{
+	RecordHeader header;
+
+	ssize_t r = ::pread(m_fd, &header, sizeof(header), index);
+
+	if ((r >= (ssize_t) sizeof(header.magic)) &&
+	    MappedIndex::isMapped(header.magic, sizeof(header.magic)))
+	{
+		lm.setBase(boost::shared_ptr<MappedIndex>(new MappedIndex(m_fd, index)));
+		return true;
+	}
+
+	// Journal records and indexes of older versions
+	// are stored in the portable archive.
+
+	io::nonclosable_file_descriptor file(m_fd);
+
+	io::filtering_istream in;
+	m_fh.type.push(in);
+
+	bool bounded = (r == (ssize_t) sizeof(header)) &&
+	               (memcmp(header.magic, RecordMagic, sizeof(header.magic)) == 0);
+
+	// The slice starts at the current position of the file.
+
+	if (bounded)
+	{
+		file.seek(index + sizeof(header), ios_base::beg);
+		in.push(io::slice(file, 0, (off_t) header.length));
+	}
+	else
+	{
+		file.seek(index, ios_base::beg);
+		in.push(file);
+	}
+
+	eos::portable_iarchive pba(in);
+	pba >> lm;
+
+	return bounded;
+}
+
+void Compress::storeFileHeader() const
+{
+	rDebug("%s: m_fd: %d", __PRETTY_FUNCTION__, m_fd);
+
+	io::nonclosable_file_descriptor file(m_fd);
 	file.seek(0, ios_base::beg);
 
 	io::filtering_ostream out;
@@ -590,42 +1166,113 @@ void Compress::storeFileHeader() const
 	pba << m_fh;
 }
 
-void Compress::storeLayerMap()
+void Compress::storeLayerMap(bool compact)
 {
 	rDebug("%s: m_fd: %d", __PRETTY_FUNCTION__, m_fd);
 
 	// Don't store LayerMap if it has not been modified
-	// since begining (open).
+	// since the last store.
 
-	if (!m_lm.isModified())
+	if (!m_lm.isModified() && !compact)
 		return;
 
-	io::nonclosable_file_descriptor file(m_fd);
-	file.seek(m_RawFileSize, ios_base::beg);
+	// Empty layer map doesn't need an index, the next write
+	// may start right after the file header.
 
-	io::filtering_ostream out;
-	m_fh.type.push(out);
-	out.push(file);
+	if (m_lm.size() == 0)
+	{
+		m_fh.index = 0;
+		m_lm.setStored();
+		return;
+	}
 
-	eos::portable_oarchive pba(out);
-	pba << m_lm;
+	// Append only the changes to the journal while the previous
+	// record is still in the file and the journal isn't full.
+
+	compact = compact || (m_fh.index == 0) || (m_fh.index >= m_RawFileSize) ||
+	          m_lm.isJournalFull(m_JournalLength, m_JournalBlocks);
+
+	off_t end;
+
+	if (compact)
+	{
+		// The whole map is stored uncompressed so that it can
+		// be mapped to the memory when the file is opened.
+
+		std::vector<char> data;
+
+		m_lm.saveMapped(data);
+
+		if (!FileUtils::writeAll(m_fd, &data[0], data.size(), m_RawFileSize))
+			throw BOOST_IOSTREAMS_FAILURE(strerror(errno));
+
+		end = m_RawFileSize + data.size();
+
+		m_JournalLength = 0;
+		m_JournalBlocks = 0;
+	}
+	else
+	{
+		m_lm.setPrevious(m_fh.index);
+
+		off_t start = m_RawFileSize + sizeof(RecordHeader);
+
+		io::nonclosable_file_descriptor file(m_fd);
+		file.seek(start, ios_base::beg);
+		{
+			io::filtering_ostream out;
+			m_fh.type.push(out);
+			out.push(file);
+
+			eos::portable_oarchive pba(out);
+			pba << m_lm;
+		}
+		end = file.seek(0, ios_base::cur);
+
+		RecordHeader header;
+
+		memcpy(header.magic, RecordMagic, sizeof(header.magic));
+		header.length = end - start;
+
+		if (!FileUtils::writeAll(m_fd, (const char *) &header, sizeof(header), m_RawFileSize))
+			throw BOOST_IOSTREAMS_FAILURE(strerror(errno));
+
+		m_JournalLength++;
+		m_JournalBlocks += m_lm.changes();
+	}
+	m_lm.setStored();
 
 	// Set the file header's index to the current offset
-	// where the index was saved.
+	// where the index was saved. Next Blocks are appended
+	// behind the index, it's a part of the journal now.
 
 	m_fh.index = m_RawFileSize;
+	m_RawFileSize = end;
 }
 
-int Compress::store()
+int Compress::store(bool compact)
 {
 	rDebug("%s", __PRETTY_FUNCTION__);
 
 	try {
 		FileRememberTimes frt(m_fd);
 
+		off_t index = m_fh.index;
+
 		// Append new index to the end of the file.
 		//
-		storeLayerMap();
+		storeLayerMap(compact);
+
+		// The file header commits the new index. Blocks and the index
+		// must be on the disk before the header points to them,
+		// otherwise a crash could leave the header pointing to
+		// data that were never written.
+		//
+		if ((m_fh.index != index) && (m_fh.index != 0))
+		{
+			if (::fdatasync(m_fd) == -1)
+				throw std::ios_base::failure(strerror(errno));
+		}
 		storeFileHeader();
 	}
 	catch (exception& e)
@@ -639,8 +1286,6 @@ int Compress::store()
 	return 0;
 }
 
-extern unsigned int g_BufferedMemorySize;
-
 // readFd - source file descriptor
 // writeFd - destination file descriptor
 // writeOffset - offset where start writing
@@ -666,6 +1311,35 @@ off_t Compress::copy(int readFd, off_t writeOffset, int writeFd, LayerMap& write
 	return writeOffset;
 }
 
+bool Compress::isCopyable(const Block& block)
+{
+	// Framing doesn't matter, both kinds of Blocks can be read.
+
+	return (block.type.getType() & ~CompressionType::Framed) ==
+	       (g_CompressionType.getType() & ~CompressionType::Framed);
+}
+
+/**
+ * Copy compressed data of Blocks that occupy the range from `runStart`
+ * to `runEnd` of the `readFd` to the `writeOffset` of the `writeFd`.
+ */
+static bool copyRun(int readFd, off_t runStart, off_t runEnd, int writeFd, off_t writeOffset)
+{
+	off_t length = runEnd - runStart;
+
+	if (length == 0)
+		return true;
+
+	if (!FileUtils::copyRange(readFd, runStart, writeFd, writeOffset, length))
+	{
+		rError("%s: Block copy failed: coffset:%lx, clength: %lx, errno: %d",
+			__PRETTY_FUNCTION__, (long int) runStart, (long int) length, errno);
+
+		return false;
+	}
+	return true;
+}
+
 off_t Compress::cleverCopy(int readFd, off_t writeOffset, int writeFd, LayerMap& writeLm)
 {
 	off_t offset = 0;
@@ -674,17 +1348,65 @@ off_t Compress::cleverCopy(int readFd, off_t writeOffset, int writeFd, LayerMap&
 	Block	 block;
 	off_t	 len;
 
+	// Compressed data of the copied Blocks that follow each other
+	// in the lower file is copied at once.
+
+	off_t	 runStart = 0;
+	off_t	 runEnd = 0;
+	off_t	 runOffset = writeOffset;	// Where the run is copied to.
+
 	while (size > 0)
 	{
 		if (!m_lm.Get(offset, block, len))
 		{
+			if (errno == EIO)
+				return -1;
+
 			// Block not found. There also is no block on a upper
 			// offset.
 			//
 			break;
 		}
 
-		if (len)
+		if (len && block.type.isZero())
+		{
+			// Nothing to hide in the new file, skip the hole.
+
+			off_t r = min(len, size);
+
+			offset += r;
+			size -= r;
+		}
+		else if (len && (offset == block.offset) && (len == (off_t) block.length) &&
+		         (len <= size) && isCopyable(block))
+		{
+			// The whole Block is visible and it's compressed by
+			// the requested method, copy its compressed data.
+
+			if ((block.coffset != runEnd) ||
+			    (writeOffset != runOffset + (runEnd - runStart)))
+			{
+				if (!copyRun(readFd, runStart, runEnd, writeFd, runOffset))
+					return -1;
+
+				runStart = runEnd = block.coffset;
+				runOffset = writeOffset;
+			}
+			runEnd += block.clength;
+
+			// Offsets of frames are relative to the start of
+			// the Block, only the Block moves.
+
+			Block bl(block);
+
+			bl.coffset = writeOffset;
+			writeLm.Put(bl);
+			writeOffset += bl.clength;
+
+			offset += len;
+			size -= len;
+		}
+		else if (len)
 		{
 			// Block covers the offset, we can read len bytes
 			// from it's de-compressed stream...
@@ -728,9 +1450,314 @@ off_t Compress::cleverCopy(int readFd, off_t writeOffset, int writeFd, LayerMap&
 		}
 	}
 
+	if (!copyRun(readFd, runStart, runEnd, writeFd, runOffset))
+		return -1;
+
 	return writeOffset;
 }
 
+bool Compress::isFragmented() const
+{
+	if (g_DefragmentRatio == 0)
+		return false;
+
+	off_t limit = max((off_t) g_DefragmentMinimum,
+	                  m_fh.size + (m_fh.size * g_DefragmentRatio) / 100);
+
+	if (m_RawFileSize <= limit)
+		return false;
+
+	// Holes punched by the DefragmentStep() don't take any
+	// space, compare the space really taken by the file.
+
+	struct stat st;
+
+	if (::fstat(m_fd, &st) == -1)
+		return false;
+
+	return (off_t) st.st_blocks * 512 > limit;
+}
+
+void Compress::scheduleDefragment()
+{
+	if (m_DefragmentQueued || !isFragmented())
+		return;
+
+	if (g_Defragmenter.isRunning())
+	{
+		// Only the files of the g_FileManager are written
+		// to while the g_Defragmenter runs.
+
+		m_DefragmentQueued = true;
+		g_Defragmenter.push(static_cast<CFile *>(this));
+	}
+	else
+		DefragmentFast();
+}
+
+int Compress::punchHoles()
+{
+#ifndef HAVE_FALLOCATE
+	errno = EOPNOTSUPP;
+	return -1;
+#else
+	// Parts of the lower file that are in use, keyed
+	// by their start offsets.
+
+	std::map<off_t, off_t> used;
+
+	used[0] = FileHeader::MaxSize;
+	if (m_fh.index != 0)
+		used[m_fh.index] = m_RawFileSize;
+
+	Block	 block;
+	off_t	 len;
+
+	for (off_t offset = 0; offset < m_fh.size; )
+	{
+		if (!m_lm.Get(offset, block, len))
+		{
+			// Nothing may be punched if the used parts
+			// are not known.
+
+			if (errno == EIO)
+				return 0;
+			break;
+		}
+		if (len == 0)
+		{
+			offset = block.offset;
+			continue;
+		}
+		if (block.type.isZero())
+		{
+			offset += len;
+			continue;
+		}
+
+		off_t &end = used[block.coffset];
+		end = max(end, (off_t) (block.coffset + block.clength));
+
+		offset += len;
+	}
+
+	// Punch a hole to every gap between them. The file system
+	// releases the whole blocks of a hole and fills the rest
+	// of it by zeros.
+
+	off_t start = 0;
+
+	for (std::map<off_t, off_t>::const_iterator it = used.begin(); ; ++it)
+	{
+		off_t end = (it == used.end()) ? m_RawFileSize : it->first;
+
+		if (start < end)
+		{
+			if (::fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) == -1)
+				return -1;
+		}
+		if (it == used.end())
+			break;
+
+		start = max(start, it->second);
+	}
+	return 0;
+#endif
+}
+
+// Visible parts of a Block, see Compress::DefragmentStep().
+
+struct BlockUsage
+{
+	Block                                 block;
+	off_t                                 visible;
+	std::vector<std::pair<off_t, off_t> > extents;	// (offset, length)
+
+	BlockUsage() :
+		visible (0)
+	{ }
+
+	// Compressed bytes of the Block that are not visible.
+
+	off_t wasted() const
+	{
+		return block.clength - (block.clength * visible) / block.olength;
+	}
+};
+
+static bool moreWasted(const BlockUsage *pU1, const BlockUsage *pU2)
+{
+	return pU1->wasted() > pU2->wasted();
+}
+
+int Compress::DefragmentStep(off_t &bytes)
+{
+	rDebug("%s: %s", __PRETTY_FUNCTION__, m_name.c_str());
+
+	off_t budget = bytes;
+
+	bytes = 0;
+	m_DefragmentQueued = false;
+
+	if (!m_IsCompressed || (m_lm.size() == 0))
+		return 0;
+
+	struct stat st;
+
+	if (::fstat(m_fd, &st) == -1)
+		return 0;
+
+	// The file has been deleted, DefragmentFast() would
+	// bring it back.
+
+	if (st.st_nlink == 0)
+		return 0;
+
+	// Relocated Blocks are appended to the end of the file,
+	// holes stay behind them. Copy the file if it consists
+	// mostly of holes.
+
+	if (m_RawFileSize / Sparse > (off_t) st.st_blocks * 512)
+		return -1;
+
+	// Check that the file system supports holes before anything
+	// is relocated, the space past the end of the file is not used.
+
+#ifdef HAVE_FALLOCATE
+	if ((::fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, m_RawFileSize, 1) == -1) &&
+	    ((errno == EOPNOTSUPP) || (errno == ENOSYS)))
+	{
+		return -1;
+	}
+#else
+	return -1;
+#endif
+
+	// Find the Blocks that are visible only partially, parts of them
+	// have been overwritten by newer Blocks or truncated.
+
+	std::map<off_t, BlockUsage> usage;	// Keyed by coffset.
+
+	Block	 block;
+	off_t	 len;
+
+	for (off_t offset = 0; offset < m_fh.size; )
+	{
+		if (!m_lm.Get(offset, block, len))
+		{
+			if (errno == EIO)
+				return 0;
+			break;
+		}
+		if (len == 0)
+		{
+			offset = block.offset;
+			continue;
+		}
+		len = min(len, m_fh.size - offset);
+
+		// Blocks of zeros don't occupy any space.
+
+		if (block.type.isZero())
+		{
+			offset += len;
+			continue;
+		}
+
+		BlockUsage &u = usage[block.coffset];
+
+		u.block = block;
+		u.visible += len;
+		u.extents.push_back(std::make_pair(offset, len));
+
+		offset += len;
+	}
+
+	std::vector<BlockUsage *> partial;
+
+	for (std::map<off_t, BlockUsage>::iterator it = usage.begin(); it != usage.end(); ++it)
+	{
+		if (it->second.visible < (off_t) it->second.block.olength)
+			partial.push_back(&it->second);
+	}
+
+	// Relocate the Blocks that waste the most space first. A new
+	// Block is appended for every visible part of a Block, it hides
+	// the same data of the old one.
+
+	std::sort(partial.begin(), partial.end(), moreWasted);
+
+	FileRememberTimes frt(m_fd);
+
+	std::vector<BlockUsage *>::const_iterator it;
+
+	for (it = partial.begin(); (it != partial.end()) && (bytes < budget); ++it)
+	{
+		const BlockUsage &u = **it;
+
+		for (size_t i = 0; i < u.extents.size(); ++i)
+		{
+			off_t offset = u.extents[i].first;
+			off_t length = u.extents[i].second;
+
+			try {
+				boost::scoped_array<char> buf(new char[length]);
+
+				readBlock(m_fd, u.block, length, length, offset, buf.get());
+
+				off_t rawFileSize = writeCompressed(m_lm, offset, m_RawFileSize, buf.get(), length, m_fd, m_RawFileSize);
+				if (rawFileSize == -1)
+				{
+					store();
+					return 0;
+				}
+				m_RawFileSize = rawFileSize;
+			}
+			catch (exception& e)
+			{
+				rError("%s: Block read failed: offset:%lx, coffset:%lx, length: %lx, clength: %lx, exception: %s",
+					__PRETTY_FUNCTION__, (long int) u.block.offset, (long int) u.block.coffset,
+				        (long int) u.block.length, (long int) u.block.clength, e.what());
+
+				store();
+				return 0;
+			}
+			bytes += length;
+		}
+	}
+
+	if (it != partial.end())
+	{
+		// The rest is relocated by the next step.
+
+		return (store() == 0) ? 1 : 0;
+	}
+
+	// Store the whole index so that the journal is not needed
+	// anymore and reload it, the map must not refer to the old
+	// index that is released now.
+
+	if (store(true) == -1)
+		return 0;
+
+	try {
+		restoreLayerMap();
+	}
+	catch (exception& e)
+	{
+		rError("%s: Failed to restore LayerMap of file '%s', exception: %s",
+			__PRETTY_FUNCTION__, m_name.c_str(), e.what());
+		return 0;
+	}
+
+	if (punchHoles() == -1)
+	{
+		rWarning("%s: Failed to punch holes to '%s', errno: %d",
+			__PRETTY_FUNCTION__, m_name.c_str(), errno);
+	}
+	return 0;
+}
+
 void Compress::DefragmentFast()
 {
 	rDebug("%s", __PRETTY_FUNCTION__);
@@ -817,15 +1844,161 @@ void Compress::DefragmentFast()
 
 	::fstat(tmp_fd, &st);
 
-	g_FileManager->Lock();
-	g_FileManager->UpdateUnlocked(dynamic_cast<CFile*>(this), st.st_ino);
+	// Forget blocks of the old file and also blocks of a deleted
+	// file that may have had the same inode number as the new one.
+
+	g_BlockCache.invalidate(m_inode);
+	g_BlockCache.invalidate(st.st_ino);
+
+	// The new file replaces the old one, it must be
+	// on the disk before the rename.
+
+	::fdatasync(tmp_fd);
+
+	g_FileManager->BeginUpdate();
+	g_FileManager->Update(dynamic_cast<CFile*>(this), st.st_ino);
 
 	if (::rename(tmp_name, m_name.c_str()) == -1)
 	{
 		rError("%s: Cannot rename '%s' to '%s'",
 			__PRETTY_FUNCTION__, tmp_name, m_name.c_str());
 	}
-	g_FileManager->Unlock();
+	g_FileManager->EndUpdate();
+}
+
+int Compress::copyTo(Compress& output)
+{
+	assert(m_IsCompressed && output.m_IsCompressed);
+	assert(output.m_lm.size() == 0);
+
+	off_t rawFileSize = cleverCopy(m_fd, output.m_RawFileSize, output.m_fd, output.m_lm);
+	if (rawFileSize == -1)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	output.m_RawFileSize = rawFileSize;
+	output.m_fh.size = m_fh.size;
+
+	return 0;
+}
+
+off_t Compress::lseek(off_t offset, int whence) const
+{
+	assert (m_fd != -1);
+
+	if ((whence != SEEK_DATA) && (whence != SEEK_HOLE))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (m_IsCompressed == false)
+		return ::lseek(m_fd, offset, whence);
+
+	if ((offset < 0) || (offset >= m_fh.size))
+	{
+		errno = ENXIO;
+		return -1;
+	}
+
+	Block	 block;
+	off_t	 len;
+
+	while (offset < m_fh.size)
+	{
+		if (!m_lm.Get(offset, block, len))
+		{
+			if (errno == EIO)
+				return -1;
+			break;
+		}
+		if (len == 0)
+		{
+			// There is no Block on the offset.
+
+			if (whence == SEEK_HOLE)
+				return offset;
+
+			offset = block.offset;
+			continue;
+		}
+
+		if (block.type.isZero() == (whence == SEEK_HOLE))
+			return offset;
+
+		offset += len;
+	}
+
+	// There is a hole at the end of every file, it starts
+	// behind the last Block.
+
+	if (whence == SEEK_HOLE)
+		return min(offset, m_fh.size);
+
+	errno = ENXIO;
+	return -1;
+}
+
+int Compress::fallocate(int mode, off_t offset, off_t length)
+{
+	assert (m_fd != -1);
+
+	rDebug("Compress::fallocate mode: 0x%x, offset: 0x%lx, length: 0x%lx",
+	       mode, (long int) offset, (long int) length);
+
+	if ((offset < 0) || (length <= 0))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Other modes move or zero the data and the size of the file,
+	// the data cached by the upper layer would not follow them.
+
+	if ((mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) &&
+	    (mode != FALLOC_FL_KEEP_SIZE) && (mode != 0))
+	{
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (m_IsCompressed == false)
+	{
+#ifdef HAVE_FALLOCATE
+		return ::fallocate(m_fd, mode, offset, length);
+#else
+		errno = EOPNOTSUPP;
+		return -1;
+#endif
+	}
+
+	switch (mode)
+	{
+	case FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE:
+
+		// Only the index changes, the data of the Blocks
+		// under the hole is released by defragmentation.
+
+		m_LastWrite = time(NULL);
+
+		putHole(offset, length);
+		scheduleDefragment();
+		return 0;
+
+	case 0:
+
+		// There is no space to reserve in a compressed
+		// file, the missing part of the file is a hole.
+
+		m_fh.size = max(m_fh.size, offset + length);
+		return 0;
+
+	default:
+		// FALLOC_FL_KEEP_SIZE
+		return 0;
+	}
 }
 
 bool Compress::isCompressedOnlyWith(CompressionType& type)
@@ -22,8 +22,10 @@
 #include "FileHeader.hpp"
 #include "LayerMap.hpp"
 #include "CompressionType.hpp"
+#include "Mutex.hpp"
 
 #include <sys/types.h>
+#include <time.h>
 
 typedef File PARENT_COMPRESS;
 
@@ -38,11 +40,32 @@ private:
 	void restoreLayerMap();
 
 	/**
-	 * Store (save) the layer map and the file header.
+	 * Load the record of the index journal stored at the `index`.
+	 * Returns false if it's a record of an older version that
+	 * extends to the end of the file.
+	 */
+	bool restoreLayerMap(off_t index, LayerMap& lm);
+
+	// Journal records are compressed, but the compressors don't know
+	// where their stream ends. The length of the compressed record
+	// stored in front of it limits the reads, Blocks and other records
+	// follow the record in the file.
+	//
+	struct RecordHeader
+	{
+		char                 magic[8];
+		MappedIndex::le64_t  length;
+	};
+
+	static const char RecordMagic[8];
+
+	/**
+	 * Store (save) the layer map and the file header. The whole
+	 * layer map is stored if `compact` is set.
 	 *
 	 * @returns 0 on success, -1 otherwise and errno set to -EIO.
 	 */
-	int store();
+	int store(bool compact = false);
 
 	/**
 	 * Store (save) the file header m_fh.
@@ -53,19 +76,99 @@ private:
 
 	/**
 	 * Store (save) the layer map m_lm (to offset m_RawFileSize) using
-	 * compression as requested by 'm_fh.type'.
+	 * compression as requested by 'm_fh.type'. Only changes since
+	 * the last store are appended to the index journal unless
+	 * the journal needs to be compacted or `compact` is set.
 	 *
 	 * @throws boost::iostreams exception on error.
 	 */
-	void storeLayerMap();
+	void storeLayerMap(bool compact);
 
 	off_t writeCompressed(LayerMap& lm, off_t offset, off_t coffset, const char *buf, size_t size, int fd, off_t rawFileSize);
+
+	/**
+	 * Append `bl.clength` bytes of already compressed data of the
+	 * block `bl` to the file and put the block to the layer map.
+	 *
+	 * @returns new length of the lower file, -1 on error.
+	 */
+	off_t appendCompressed(Block& bl, const char *cbuf);
+
+	/**
+	 * Split the `buf` into blocks of g_BufferedMemorySize, compress
+	 * them by the g_ThreadPool and append them to the file in order.
+	 *
+	 * @returns new length of the lower file, -1 on error.
+	 */
+	off_t writeParallel(off_t offset, const char *buf, size_t size);
+
+	/**
+	 * Compress the `buf` and append it to the file as one or more
+	 * blocks, see writeParallel().
+	 *
+	 * @returns 0 on success, -1 on error.
+	 */
+	int writeData(off_t offset, const char *buf, size_t size);
+
+	/**
+	 * Put a Block of zeros without any data to the layer map.
+	 */
+	void putHole(off_t offset, size_t length);
+
+	/**
+	 * Write the `buf` as writeData() does, but store runs of zeros
+	 * that cover whole chunks of HoleMinimum bytes as holes.
+	 *
+	 * @returns 0 on success, -1 on error.
+	 */
+	int writeSparse(off_t offset, const char *buf, size_t size);
 	off_t readBlock(int fd, const Block& block, off_t size, off_t len, off_t offset, char *buf) const;
 	ssize_t readCompressed(char *buf, size_t size, off_t offset, int fd) const;
+
+	/**
+	 * Queue decompression of blocks (or frames of framed blocks)
+	 * that follow the block which covers the `offset`.
+	 */
+	void readAhead(off_t offset) const;
 	off_t copy(int readFd, off_t writeOffset, int writeFd, LayerMap& writeLm);
+
+	/**
+	 * Copy data of the whole Block without recompression if it's
+	 * compressed by the g_CompressionType.
+	 */
+	static bool isCopyable(const Block& block);
+
+	/**
+	 * Copy the visible data of the file to the `writeOffset` of the
+	 * `writeFd` and put the new Blocks to the `writeLm`. Blocks that
+	 * are visible as a whole are copied without recompression
+	 * if possible, see isCopyable(). Runs of such Blocks that are
+	 * adjacent in the lower file are copied by one call.
+	 *
+	 * @returns offset behind the copied data, -1 on error.
+	 */
 	off_t cleverCopy(int readFd, off_t writeOffset, int writeFd, LayerMap& writeLm);
 
-	void DefragmentFast();
+	/**
+	 * Returns true if the lower file occupies more space than
+	 * allowed by g_DefragmentRatio.
+	 */
+	bool isFragmented() const;
+
+	/**
+	 * Queue the file to be defragmented by the g_Defragmenter if it's
+	 * fragmented. The file is defragmented immediately if the
+	 * g_Defragmenter doesn't run.
+	 */
+	void scheduleDefragment();
+
+	/**
+	 * Punch holes to the parts of the lower file that are not used
+	 * by the file header, the visible Blocks and the index.
+	 *
+	 * @returns 0 on success, -1 otherwise and errno set.
+	 */
+	int punchHoles();
 
 	// Length of the lower file
 	// (not as seen by the user via fuse mount point).
@@ -74,6 +177,36 @@ private:
 
 	bool	 m_IsCompressed;
 
+	// Number of journal records following the last record
+	// with the whole layer map and number of Blocks in them.
+	//
+	unsigned int m_JournalLength;
+	size_t       m_JournalBlocks;
+
+	// Time of the last write, the file is defragmented
+	// when it's not written to for a while.
+	//
+	time_t	 m_LastWrite;
+	bool	 m_DefragmentQueued;
+
+	// The whole file is copied when the lower file takes more than
+	// Sparse times the space it occupies, holes punched by the
+	// DefragmentStep() are left behind the relocated Blocks.
+	//
+	static const unsigned int Sparse = 4;
+
+	// Shorter runs of zeros are compressed with the data around
+	// them, they compress well and the index doesn't grow.
+	//
+	static const unsigned int HoleMinimum = 64 * 1024;
+
+	// Offset following the last read, used to detect
+	// sequential reading. Protected by m_ReadAheadMutex,
+	// read() is called with the file locked shared only.
+	//
+	mutable off_t m_ReadAheadOffset;
+	mutable Mutex m_ReadAheadMutex;
+
 	// Items used when a file is compressed.
 	//
 	FileHeader m_fh;
@@ -97,7 +230,7 @@ public:
 
 	int truncate(const char *name, off_t size);
 
-	int getattr(const char *name, struct stat *st);
+	int getattr(const char *name, struct stat *st, bool known = false);
 
 	ssize_t read(char *buf, size_t size, off_t offset) const;
 
@@ -106,6 +239,69 @@ public:
 	bool isCompressed() { return m_IsCompressed; }
 	void setCompressed(bool compressed) { m_IsCompressed = compressed; if (!compressed) m_RawFileSize = 0; }
 	bool isCompressedOnlyWith(CompressionType& type);
+
+	/**
+	 * Find the data (SEEK_DATA) or the hole (SEEK_HOLE) that
+	 * follows the `offset` the same way as lseek(2) does, it
+	 * doesn't change any file offset. Parts of the file without
+	 * Blocks and Blocks of zeros are holes.
+	 *
+	 * @returns the offset found, -1 on error and errno set
+	 *          (ENXIO if there is no data behind the offset).
+	 */
+	off_t lseek(off_t offset, int whence) const;
+
+	/**
+	 * Manipulate the space of the file the same way as fallocate(2)
+	 * does. Only allocation (with or without FALLOC_FL_KEEP_SIZE)
+	 * and FALLOC_FL_PUNCH_HOLE are supported. Punching a hole to
+	 * a compressed file puts a Block of zeros to the index.
+	 *
+	 * @returns 0 on success, -1 otherwise and errno set.
+	 */
+	int fallocate(int mode, off_t offset, off_t length);
+
+	/**
+	 * Copy the content of the file to the `output`, a new empty
+	 * compressed file, see cleverCopy(). Both files must be open.
+	 *
+	 * @returns 0 on success, -1 otherwise and errno set.
+	 */
+	int copyTo(Compress& output);
+
+	time_t getLastWrite() const { return m_LastWrite; }
+
+	/**
+	 * Writes kept in the Memory layer postpone
+	 * the defragmentation too.
+	 */
+	void setLastWrite(time_t lastWrite) { m_LastWrite = lastWrite; }
+
+	/**
+	 * Used by the g_Defragmenter when it drops the file
+	 * from the queue without defragmenting it.
+	 */
+	void setDefragmentQueued(bool queued) { m_DefragmentQueued = queued; }
+
+	/**
+	 * Defragment a part of the file in place. Visible parts of the
+	 * Blocks that are partially overwritten or truncated are appended
+	 * to the file (at most `bytes` of them) and the space they took is
+	 * released by punching holes to the lower file once there are
+	 * no such Blocks left. The number of bytes really copied is
+	 * returned in `bytes`.
+	 *
+	 * @returns 1 if there is more work to do, 0 if the file has been
+	 *          defragmented and -1 if it can't be done in place,
+	 *          DefragmentFast() must be used then.
+	 */
+	int DefragmentStep(off_t &bytes);
+
+	/**
+	 * Copy the visible data of the file to a new lower file
+	 * that replaces the current one.
+	 */
+	void DefragmentFast();
 };
 
 #endif
@@ -22,18 +22,29 @@
 #endif
 #ifdef HAVE_LIBZ
 #include <boost/iostreams/filter/zlib.hpp>
+#include <zlib.h>
 #endif
 #ifdef HAVE_LIBBZ2
 #include <boost/iostreams/filter/bzip2.hpp>
+#include <bzlib.h>
 #endif
 #ifdef HAVE_LIBLZO2
 #include <boost/iostreams/filter/lzo.hpp>
 #endif
+#ifdef HAVE_LIBZSTD
+#include <boost/iostreams/filter/zstd.hpp>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <boost/iostreams/filter/lz4.hpp>
+#endif
 #include <boost/iostreams/filter/xor.hpp>
 #include <boost/iostreams/traits.hpp>
+#include <boost/scoped_array.hpp>
 
 #include "CompressionType.hpp"
 
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 void CompressionType::printAllSupportedMethods(std::ostream& os)
@@ -50,6 +61,12 @@ void CompressionType::printAllSupportedMethods(std::ostream& os)
 #endif
 #ifdef HAVE_LIBLZMA
 	os << "lzma, ";
+#endif
+#ifdef HAVE_LIBZSTD
+	os << "zstd, ";
+#endif
+#ifdef HAVE_LIBLZ4
+	os << "lz4, ";
 #endif
 	os << "xor";
 }
@@ -58,10 +75,13 @@ std::ostream& operator<<(std::ostream& os, const CompressionType& rObj)
 {
 	std::string name;
 
-	switch (rObj.m_Type) {
+	switch (rObj.m_Type & ~CompressionType::Framed) {
 	case CompressionType::NONE:
 		name = "none";
 		break;
+	case CompressionType::NONE | CompressionType::Zero:
+		name = "zero";
+		break;
 	case CompressionType::XOR:
 		name = "xor";
 		break;
@@ -77,24 +97,32 @@ std::ostream& operator<<(std::ostream& os, const CompressionType& rObj)
 	case CompressionType::LZMA:
 		name = "lzma";
 		break;
+	case CompressionType::ZSTD:
+		name = "zstd";
+		break;
+	case CompressionType::LZ4:
+		name = "lz4";
+		break;
 	}
+	if (rObj.isFramed())
+		name += " (framed)";
 	return os << name;
 }
 
 template<>
-void CompressionType::push(io::filtering_stream<io::output>& fs) const
+void CompressionType::push(io::filtering_stream<io::output>& fs, size_t /*length*/) const
 {
-	switch (m_Type) {
+	switch (m_Type & ~Framed) {
 	case NONE:
 		break;
 #ifdef HAVE_LIBZ
 	case ZLIB:
-		fs.push(io::zlib_compressor(io::zlib_params(9, io::zlib::deflated, 15, 8, io::zlib::default_strategy, true)));
+		fs.push(io::zlib_compressor(io::zlib_params(level(9), io::zlib::deflated, 15, 8, io::zlib::default_strategy, true)));
 		break;
 #endif
 #ifdef HAVE_LIBBZ2
 	case BZIP2:
-		fs.push(io::bzip2_compressor());
+		fs.push(io::bzip2_compressor(level(io::bzip2::default_block_size)));
 		break;
 #endif
 	case XOR:
@@ -107,7 +135,17 @@ void CompressionType::push(io::filtering_stream<io::output>& fs) const
 #endif
 #ifdef HAVE_LIBLZMA
 	case LZMA:
-		fs.push(io::lzma_compressor());
+		fs.push(io::lzma_compressor(level(io::lzma::default_compression)));
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case ZSTD:
+		fs.push(io::zstd_compressor(level(io::zstd::default_compression)));
+		break;
+#endif
+#ifdef HAVE_LIBLZ4
+	case LZ4:
+		fs.push(io::lz4_compressor(level(io::lz4::default_compression)));
 		break;
 #endif
 	default:
@@ -121,9 +159,9 @@ void CompressionType::push(io::filtering_stream<io::output>& fs) const
 }
 
 template<>
-void CompressionType::push(io::filtering_stream<io::input>& fs) const
+void CompressionType::push(io::filtering_stream<io::input>& fs, size_t length) const
 {
-	switch (m_Type) {
+	switch (m_Type & ~Framed) {
 	case NONE:
 		break;
 #ifdef HAVE_LIBZ
@@ -141,13 +179,23 @@ void CompressionType::push(io::filtering_stream<io::input>& fs) const
 		break;
 #ifdef HAVE_LIBLZO2
 	case LZO:
-		fs.push(io::lzo_decompressor());
+		fs.push(io::lzo_decompressor(length));
 		break;
 #endif
 #ifdef HAVE_LIBLZMA
 	case LZMA:
 		fs.push(io::lzma_decompressor());
 		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case ZSTD:
+		fs.push(io::zstd_decompressor());
+		break;
+#endif
+#ifdef HAVE_LIBLZ4
+	case LZ4:
+		fs.push(io::lz4_decompressor());
+		break;
 #endif
 	default:
 	{
@@ -161,31 +209,394 @@ void CompressionType::push(io::filtering_stream<io::input>& fs) const
 	}
 }
 
+void CompressionType::compress(const char *src, size_t size, std::vector<char>& dest) const
+{
+	size_t pos = dest.size();
+
+	switch (m_Type & ~Framed) {
+	case NONE:
+		dest.insert(dest.end(), src, src + size);
+		break;
+	case XOR:
+		dest.resize(pos + size);
+		for (size_t i = 0; i < size; ++i)
+			dest[pos + i] = src[i] ^ '2';
+		break;
+#ifdef HAVE_LIBZ
+	case ZLIB:
+	{
+		z_stream s;
+
+		memset(&s, 0, sizeof(s));
+
+		// Raw deflate stream, the same as the zlib_compressor
+		// with the noheader parameter set produces.
+
+		if (deflateInit2(&s, level(9), Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw BOOST_IOSTREAMS_FAILURE("zlib: deflateInit2 failed");
+
+		dest.resize(pos + deflateBound(&s, size));
+
+		s.next_in = (Bytef *) src;
+		s.avail_in = size;
+		s.next_out = (Bytef *) &dest[pos];
+		s.avail_out = dest.size() - pos;
+
+		int ret = deflate(&s, Z_FINISH);
+		deflateEnd(&s);
+		if (ret != Z_STREAM_END)
+			throw BOOST_IOSTREAMS_FAILURE("zlib: deflate failed");
+
+		dest.resize(pos + s.total_out);
+		break;
+	}
+#endif
+#ifdef HAVE_LIBBZ2
+	case BZIP2:
+	{
+		unsigned int len = size + size / 100 + 600;
+
+		dest.resize(pos + len);
+		if (BZ2_bzBuffToBuffCompress(&dest[pos], &len, (char *) src, size,
+		                             level(io::bzip2::default_block_size), 0,
+		                             io::bzip2::default_work_factor) != BZ_OK)
+			throw BOOST_IOSTREAMS_FAILURE("bzip2: compression failed");
+
+		dest.resize(pos + len);
+		break;
+	}
+#endif
+#ifdef HAVE_LIBLZO2
+	case LZO:
+	{
+		lzo_uint len = size + size / 16 + 64 + 3;
+
+		HEAP_ALLOC(wrkmem, LZO1X_1_MEM_COMPRESS);
+
+		dest.resize(pos + len);
+		if (lzo1x_1_compress((lzo_bytep) src, size,
+		                     (lzo_bytep) &dest[pos], &len, wrkmem) != LZO_E_OK)
+			throw BOOST_IOSTREAMS_FAILURE("lzo: compression failed");
+
+		dest.resize(pos + len);
+		break;
+	}
+#endif
+#ifdef HAVE_LIBLZMA
+	case LZMA:
+	{
+		size_t len = 0;
+
+		dest.resize(pos + lzma_stream_buffer_bound(size));
+		if (lzma_easy_buffer_encode(level(io::lzma::default_compression), LZMA_CHECK_CRC32, NULL,
+		                            (const uint8_t *) src, size,
+		                            (uint8_t *) &dest[pos], &len, dest.size() - pos) != LZMA_OK)
+			throw BOOST_IOSTREAMS_FAILURE("lzma: compression failed");
+
+		dest.resize(pos + len);
+		break;
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	case ZSTD:
+	{
+		dest.resize(pos + ZSTD_compressBound(size));
+
+		size_t len = ZSTD_compress(&dest[pos], dest.size() - pos, src, size,
+		                           level(io::zstd::default_compression));
+		if (ZSTD_isError(len))
+			throw BOOST_IOSTREAMS_FAILURE(ZSTD_getErrorName(len));
+
+		dest.resize(pos + len);
+		break;
+	}
+#endif
+#ifdef HAVE_LIBLZ4
+	case LZ4:
+	{
+		int bound = LZ4_compressBound(size);
+		int len;
+
+		if ((bound == 0) && (size > 0))
+			throw BOOST_IOSTREAMS_FAILURE("lz4: input too large");
+
+		dest.resize(pos + io::lz4::header_size + bound);
+		io::lz4::write_header(&dest[pos], size);
+
+		if (size == 0)
+			break;
+
+		if (level(io::lz4::default_compression) > 1)
+			len = LZ4_compress_HC(src, &dest[pos + io::lz4::header_size], size, bound,
+			                      level(io::lz4::default_compression));
+		else
+			len = LZ4_compress_default(src, &dest[pos + io::lz4::header_size], size, bound);
+		if (len <= 0)
+			throw BOOST_IOSTREAMS_FAILURE("lz4: compression failed");
+
+		dest.resize(pos + io::lz4::header_size + len);
+		break;
+	}
+#endif
+	default:
+	{
+		// This shall never happen, the same as for the
+		// OUTPUT filtering stream.
+
+		assert(false);
+		throw BOOST_IOSTREAMS_FAILURE("unsupported compression type");
+	}
+	}
+}
+
+void CompressionType::decompress(const char *src, size_t size, char *dest, size_t length, size_t olength) const
+{
+	unsigned char method = m_Type & ~Framed;
+
+	// These codecs can't stop in the middle of the data. Decompress
+	// all of it to a temporary buffer if only a part is needed.
+
+	if ((length < olength) && ((method == LZO) || (method == ZSTD) || (method == LZ4)))
+	{
+		boost::scoped_array<char> tmp(new char[olength]);
+
+		decompress(src, size, tmp.get(), olength, olength);
+		memcpy(dest, tmp.get(), length);
+		return;
+	}
+
+	switch (method) {
+	case NONE:
+		if (size < length)
+			throw BOOST_IOSTREAMS_FAILURE("short block");
+		memcpy(dest, src, length);
+		break;
+	case XOR:
+		if (size < length)
+			throw BOOST_IOSTREAMS_FAILURE("short block");
+		for (size_t i = 0; i < length; ++i)
+			dest[i] = src[i] ^ '2';
+		break;
+#ifdef HAVE_LIBZ
+	case ZLIB:
+	{
+		z_stream s;
+		int ret = Z_OK;
+
+		memset(&s, 0, sizeof(s));
+		if (inflateInit2(&s, -15) != Z_OK)
+			throw BOOST_IOSTREAMS_FAILURE("zlib: inflateInit2 failed");
+
+		s.next_in = (Bytef *) src;
+		s.avail_in = size;
+		s.next_out = (Bytef *) dest;
+		s.avail_out = length;
+
+		// Stop as soon as the first `length` bytes are decompressed.
+
+		while ((s.avail_out > 0) && (ret == Z_OK))
+			ret = inflate(&s, Z_NO_FLUSH);
+		inflateEnd(&s);
+
+		if (s.avail_out > 0)
+			throw BOOST_IOSTREAMS_FAILURE("zlib: corrupted block");
+		break;
+	}
+#endif
+#ifdef HAVE_LIBBZ2
+	case BZIP2:
+	{
+		bz_stream s;
+		int ret = BZ_OK;
+
+		memset(&s, 0, sizeof(s));
+		if (BZ2_bzDecompressInit(&s, 0, 0) != BZ_OK)
+			throw BOOST_IOSTREAMS_FAILURE("bzip2: BZ2_bzDecompressInit failed");
+
+		s.next_in = (char *) src;
+		s.avail_in = size;
+		s.next_out = dest;
+		s.avail_out = length;
+
+		while ((s.avail_out > 0) && (ret == BZ_OK))
+		{
+			unsigned int avail = s.avail_out;
+
+			ret = BZ2_bzDecompress(&s);
+
+			// No progress without more input, the block is truncated.
+
+			if ((ret == BZ_OK) && (s.avail_in == 0) && (s.avail_out == avail))
+				break;
+		}
+		BZ2_bzDecompressEnd(&s);
+
+		if (s.avail_out > 0)
+			throw BOOST_IOSTREAMS_FAILURE("bzip2: corrupted block");
+		break;
+	}
+#endif
+#ifdef HAVE_LIBLZO2
+	case LZO:
+	{
+		lzo_uint len = length;
+
+		if ((lzo1x_decompress_safe((lzo_bytep) src, size,
+		                           (lzo_bytep) dest, &len, NULL) != LZO_E_OK) ||
+		    (len != length))
+			throw BOOST_IOSTREAMS_FAILURE("lzo: corrupted block");
+		break;
+	}
+#endif
+#ifdef HAVE_LIBLZMA
+	case LZMA:
+	{
+		lzma_stream s = LZMA_STREAM_INIT;
+		lzma_ret ret = LZMA_OK;
+
+		if (lzma_stream_decoder(&s, 100 * 1024 * 1024, 0) != LZMA_OK)
+			throw BOOST_IOSTREAMS_FAILURE("lzma: lzma_stream_decoder failed");
+
+		s.next_in = (const uint8_t *) src;
+		s.avail_in = size;
+		s.next_out = (uint8_t *) dest;
+		s.avail_out = length;
+
+		while ((s.avail_out > 0) && (ret == LZMA_OK))
+			ret = lzma_code(&s, LZMA_FINISH);
+		lzma_end(&s);
+
+		if (s.avail_out > 0)
+			throw BOOST_IOSTREAMS_FAILURE("lzma: corrupted block");
+		break;
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	case ZSTD:
+	{
+		size_t ret = ZSTD_decompress(dest, length, src, size);
+
+		if (ZSTD_isError(ret))
+			throw BOOST_IOSTREAMS_FAILURE(ZSTD_getErrorName(ret));
+		if (ret != length)
+			throw BOOST_IOSTREAMS_FAILURE("zstd: corrupted block");
+		break;
+	}
+#endif
+#ifdef HAVE_LIBLZ4
+	case LZ4:
+	{
+		if ((size < (size_t) io::lz4::header_size) ||
+		    (io::lz4::read_header(src) != length))
+			throw BOOST_IOSTREAMS_FAILURE("lz4: corrupted block");
+		if (length == 0)
+			break;
+
+		int ret = LZ4_decompress_safe(src + io::lz4::header_size, dest,
+		                              size - io::lz4::header_size, length);
+		if ((ret < 0) || ((size_t) ret != length))
+			throw BOOST_IOSTREAMS_FAILURE("lz4: corrupted block");
+		break;
+	}
+#endif
+	default:
+	{
+		// The same as for the INPUT filtering stream.
+
+		throw BOOST_IOSTREAMS_FAILURE("unsupported compression type");
+	}
+	}
+}
+
+bool CompressionType::levelRange(unsigned char type, int& min, int& max)
+{
+	switch (type & ~Framed) {
+	case ZLIB:
+	case BZIP2:
+		min = 1;
+		max = 9;
+		break;
+	case LZMA:
+		min = 0;
+		max = 9;
+		break;
+#ifdef HAVE_LIBZSTD
+	case ZSTD:
+		min = 1;
+		max = ZSTD_maxCLevel();
+		break;
+#endif
+#ifdef HAVE_LIBLZ4
+	case LZ4:
+		min = 1;
+		max = LZ4HC_CLEVEL_MAX;
+		break;
+#endif
+	default:
+		return false;
+	}
+	return true;
+}
+
 bool CompressionType::parseType(std::string type)
 {
+	int level = DefaultLevel;
+
+	std::string::size_type colon = type.find(':');
+	if (colon != std::string::npos)
+	{
+		const char *str = type.c_str() + colon + 1;
+		char *end;
+
+		level = strtol(str, &end, 10);
+		if ((*str == '\0') || (*end != '\0') || (level < 0))
+			return false;
+		type.erase(colon);
+	}
+
+	unsigned char t;
+
 	if (type == "none")
-		m_Type = NONE;
+		t = NONE;
 #ifdef HAVE_LIBZ
 	else if (type == "zlib")
-		m_Type = ZLIB;
+		t = ZLIB;
 #endif
 #ifdef HAVE_LIBBZ2
 	else if (type == "bzip2")
-		m_Type = BZIP2;
+		t = BZIP2;
 #endif
 	else if (type == "xor")
-		m_Type = XOR;
+		t = XOR;
 #ifdef HAVE_LIBLZO2
 	else if (type == "lzo")
-		m_Type = LZO;
+		t = LZO;
 #endif
 #ifdef HAVE_LIBLZMA
 	else if (type == "lzma")
-		m_Type = LZMA;
+		t = LZMA;
+#endif
+#ifdef HAVE_LIBZSTD
+	else if (type == "zstd")
+		t = ZSTD;
+#endif
+#ifdef HAVE_LIBLZ4
+	else if (type == "lz4")
+		t = LZ4;
 #endif
 	else
 		return false;
 
+	if (level != DefaultLevel)
+	{
+		int min, max;
+
+		if (!levelRange(t, min, max) || (level < min) || (level > max))
+			return false;
+	}
+
+	m_Type = t;
+	m_Level = level;
+
 	return true;
 }
-
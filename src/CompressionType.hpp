@@ -25,6 +25,7 @@
 #include <boost/serialization/version.hpp>
 
 #include <iostream>
+#include <vector>
 
 namespace io = boost::iostreams;
 
@@ -32,6 +33,12 @@ class CompressionType
 {
 	unsigned char m_Type;
 
+	// Compression level, it isn't serialized as only the
+	// compressor needs it. A char is enough for levels of all
+	// methods and keeps copies stored for every Block small.
+	//
+	signed char m_Level;
+
 	friend class boost::serialization::access;
 
 	template<class Archive>
@@ -47,9 +54,16 @@ public:
 		ZLIB	= 2,
 		BZIP2	= 3,
 		LZO	= 4,
-		LZMA	= 5
+		LZMA	= 5,
+		ZSTD	= 6,
+		LZ4	= 7
 	};
 
+	// Level used when the user doesn't set any, every
+	// method has its own default.
+	//
+	static const int DefaultLevel = -1;
+
 	CompressionType() :
 #ifdef HAVE_LIBZ
 			m_Type (ZLIB)
@@ -59,13 +73,29 @@ public:
 			m_Type(BZIP2)
 #elif HAVE_LIBLZMA
 			m_Type(LZMA)
+#elif HAVE_LIBZSTD
+			m_Type(ZSTD)
+#elif HAVE_LIBLZ4
+			m_Type(LZ4)
 #else
 			m_Type(NONE)
 #endif
+		, m_Level(DefaultLevel)
 	{ }
 
+	// Flag of the types of Blocks that are compressed as a sequence
+	// of independently compressed frames, see Block::frames.
+	//
+	static const unsigned char Framed = 0x80;
+
+	// Flag of the types of Blocks that contain only zeros. They
+	// have no compressed data, their method is NONE.
+	//
+	static const unsigned char Zero = 0x40;
+
 	CompressionType(unsigned char type) :
-		m_Type(type)
+		m_Type(type),
+		m_Level(DefaultLevel)
 	{
 		// These asserts checks programming error. If
 		// some compression method is not supported no
@@ -73,29 +103,87 @@ public:
 		// with that unsupported compression type.
 
 #ifndef HAVE_LIBZ
-		assert(type != ZLIB);
+		assert((type & ~Framed) != ZLIB);
 #endif
 #ifndef HAVE_LIBLZO2
-		assert(type != LZO);
+		assert((type & ~Framed) != LZO);
 #endif
 #ifndef HAVE_LIBBZ2
-		assert(type != BZIP2);
+		assert((type & ~Framed) != BZIP2);
 #endif
 #ifndef HAVE_LIBLZMA
-		assert(type != LZMA);
+		assert((type & ~Framed) != LZMA);
+#endif
+#ifndef HAVE_LIBZSTD
+		assert((type & ~Framed) != ZSTD);
+#endif
+#ifndef HAVE_LIBLZ4
+		assert((type & ~Framed) != LZ4);
 #endif
 	}
 
-	CompressionType(const CompressionType& src) : m_Type (src.m_Type) { }
+	CompressionType(const CompressionType& src) :
+		m_Type (src.m_Type),
+		m_Level (src.m_Level) { }
 
+	// Accepts name of the method optionally followed by
+	// the compression level, e.g. "zstd:19".
+	//
 	bool parseType(std::string type);
 
+	bool isFramed() const { return m_Type & Framed; }
+	bool isZero() const { return m_Type & Zero; }
+
+	// The type as stored in the MappedIndex.
+	//
+	unsigned char getType() const { return m_Type; }
+	void setType(unsigned char type) { m_Type = type; }
+
+	int level(int def) const
+	{
+		return m_Level == DefaultLevel ? def : m_Level;
+	}
+
+	void setFramed(bool framed)
+	{
+		if (framed)
+			m_Type |= Framed;
+		else
+			m_Type &= ~Framed;
+	}
+
+	/**
+	 * Push the compressor or decompressor to the `fs`.
+	 *
+	 * @param length - size of the decompressed data if known,
+	 *                 decompressors may use it to avoid guessing
+	 */
 	template<typename Mode>
-	void push(io::filtering_stream<Mode>& fs) const;
+	void push(io::filtering_stream<Mode>& fs, size_t length = 0) const;
+
+	/**
+	 * Compress `size` bytes of the `src` and append the compressed
+	 * data to the `dest`. The result is the same format the
+	 * filters pushed by push() produce. Throws on error.
+	 */
+	void compress(const char *src, size_t size, std::vector<char>& dest) const;
+
+	/**
+	 * Decompress first `length` bytes of the `olength` bytes of data
+	 * compressed in the `size` bytes of the `src` to the `dest`.
+	 * Throws on error.
+	 */
+	void decompress(const char *src, size_t size, char *dest, size_t length, size_t olength) const;
+
+	// Range of levels supported by the method, returns
+	// false if the method doesn't support levels.
+	//
+	static bool levelRange(unsigned char type, int& min, int& max);
 
 	CompressionType& operator=(const CompressionType& src)
 	{
 		m_Type = src.m_Type;
+		m_Level = src.m_Level;
 
 		return *this;
 	}
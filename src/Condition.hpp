@@ -0,0 +1,106 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CONDITION_H
+#define CONDITION_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "rlog/rlog.h"
+#include "Mutex.hpp"
+
+class Condition
+{
+	pthread_cond_t	m_Cond;
+
+public:
+	Condition()
+	{
+		int r = pthread_cond_init(&m_Cond, NULL);
+		if (r != 0)
+		{
+			rError("%s failed (%s)", __PRETTY_FUNCTION__, strerror(r));
+			kill(0, SIGABRT);
+		}
+	}
+
+	~Condition()
+	{
+		int r = pthread_cond_destroy(&m_Cond);
+		if (r != 0)
+		{
+			rError("%s failed (%s)", __PRETTY_FUNCTION__, strerror(r));
+			kill(0, SIGABRT);
+		}
+	}
+
+	/**
+	 * Caller must hold the rMutex.
+	 */
+	void Wait(Mutex &rMutex)
+	{
+		int r = pthread_cond_wait(&m_Cond, &rMutex.m_Mutex);
+		if (r != 0)
+		{
+			rError("%s failed (%s)", __PRETTY_FUNCTION__, strerror(r));
+			kill(0, SIGABRT);
+		}
+	}
+
+	/**
+	 * Caller must hold the rMutex. Returns false if the time
+	 * rAbsTime passed before the condition was signaled.
+	 */
+	bool TimedWait(Mutex &rMutex, const struct timespec &rAbsTime)
+	{
+		int r = pthread_cond_timedwait(&m_Cond, &rMutex.m_Mutex, &rAbsTime);
+		if (r == ETIMEDOUT)
+			return false;
+		if (r != 0)
+		{
+			rError("%s failed (%s)", __PRETTY_FUNCTION__, strerror(r));
+			kill(0, SIGABRT);
+		}
+		return true;
+	}
+
+	void Signal(void)
+	{
+		int r = pthread_cond_signal(&m_Cond);
+		if (r != 0)
+		{
+			rError("%s failed (%s)", __PRETTY_FUNCTION__, strerror(r));
+			kill(0, SIGABRT);
+		}
+	}
+
+	void Broadcast(void)
+	{
+		int r = pthread_cond_broadcast(&m_Cond);
+		if (r != 0)
+		{
+			rError("%s failed (%s)", __PRETTY_FUNCTION__, strerror(r));
+			kill(0, SIGABRT);
+		}
+	}
+};
+
+#endif
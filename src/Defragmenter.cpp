@@ -0,0 +1,278 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "rlog/rlog.h"
+#include "assert.h"
+
+#include "Defragmenter.hpp"
+#include "FileManager.hpp"
+#include "Lock.hpp"
+
+extern FileManager	*g_FileManager;
+extern unsigned int	 g_BufferedMemorySize;
+
+// Programs start the thread if they want files
+// to be defragmented in the background.
+
+Defragmenter g_Defragmenter;
+
+Defragmenter::Defragmenter() :
+	m_running (false),
+	m_stop (false),
+	m_rate (0)
+{
+}
+
+Defragmenter::~Defragmenter()
+{
+	stop();
+}
+
+void *Defragmenter::worker(void *arg)
+{
+	Defragmenter *defragmenter = reinterpret_cast<Defragmenter *> (arg);
+
+	while (true)
+	{
+		CFile *file;
+		{
+			Lock lock(defragmenter->m_mutex);
+
+			while (!defragmenter->m_stop)
+			{
+				if (defragmenter->m_queue.empty())
+				{
+					defragmenter->m_cond.Wait(defragmenter->m_mutex);
+				}
+				else if (defragmenter->m_queue.front().due > time(NULL))
+				{
+					struct timespec due = { defragmenter->m_queue.front().due, 0 };
+
+					defragmenter->m_cond.TimedWait(defragmenter->m_mutex, due);
+				}
+				else
+					break;
+			}
+
+			if (defragmenter->m_stop)
+				break;
+
+			file = defragmenter->m_queue.front().file;
+			defragmenter->m_queue.pop_front();
+			defragmenter->m_queued.erase(file);
+		}
+
+		defragmenter->defragment(file);
+	}
+	return NULL;
+}
+
+void Defragmenter::defragment(CFile *file)
+{
+	// The reference taken by push() is ours now.
+
+	file->Lock();
+
+	rDebug("%s: %s", __PRETTY_FUNCTION__, file->getName().c_str());
+
+	// Renames and unlinks lock the file, the name can't be changed
+	// between lstat() and open(). If the name doesn't belong to the
+	// file anymore (an unlink raced with cancel()) the file is
+	// not defragmented, it's queued again by the next write.
+
+	struct stat st;
+
+	if ((lstat(file->getName().c_str(), &st) == -1) ||
+	    (st.st_ino != file->getInode()) ||
+	    (file->open(file->getName().c_str(), O_RDWR) == -1))
+	{
+		rDebug("%s: Failed to open '%s', errno: %d",
+			__PRETTY_FUNCTION__, file->getName().c_str(), errno);
+
+		file->setDefragmentQueued(false);
+		file->Unlock();
+		g_FileManager->Put(file);
+		return;
+	}
+
+	while (true)
+	{
+		// Let the writers finish first, the file would
+		// only get fragmented again.
+
+		time_t due = file->getLastWrite() + Idle;
+
+		if (due > time(NULL))
+		{
+			push(file, due);
+			break;
+		}
+
+		off_t bytes = (off_t) Step * g_BufferedMemorySize;
+
+		int r = file->DefragmentStep(bytes);
+		if (r == -1)
+		{
+			// Holes can't be punched to the lower
+			// file, copy the whole file instead.
+
+			file->DefragmentFast();
+			break;
+		}
+		if (r == 0)
+			break;
+
+		// Give the users of the file a chance to access it.
+
+		file->Unlock();
+		bool cont = pause(bytes);
+		file->Lock();
+
+		if (!cont)
+			break;
+	}
+
+	file->release(file->getName().c_str());
+
+	file->Unlock();
+	g_FileManager->Put(file);
+}
+
+bool Defragmenter::pause(off_t bytes)
+{
+	Lock lock(m_mutex);
+
+	if ((m_rate > 0) && (bytes > 0))
+	{
+		struct timespec until;
+		long long ns = (long long) bytes * 1000000000LL / m_rate;
+
+		clock_gettime(CLOCK_REALTIME, &until);
+
+		until.tv_sec += ns / 1000000000LL;
+		until.tv_nsec += ns % 1000000000LL;
+		if (until.tv_nsec >= 1000000000L)
+		{
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+
+		// Queued files wake us up as well, sleep until
+		// the time passes or the thread is stopped.
+
+		while (!m_stop && m_cond.TimedWait(m_mutex, until))
+			;
+	}
+	return !m_stop;
+}
+
+void Defragmenter::start()
+{
+	assert(!m_running);
+
+	m_stop = false;
+
+	int r = pthread_create(&m_thread, NULL, Defragmenter::worker, this);
+	if (r != 0)
+	{
+		rError("%s: Failed to create the defragmenter thread (%s)",
+			__PRETTY_FUNCTION__, strerror(r));
+		return;
+	}
+	m_running = true;
+}
+
+void Defragmenter::stop()
+{
+	if (!m_running)
+		return;
+	{
+		Lock lock(m_mutex);
+
+		m_stop = true;
+		m_cond.Broadcast();
+	}
+
+	pthread_join(m_thread, NULL);
+	m_running = false;
+
+	// The files are dropped without being defragmented,
+	// the next write queues them again.
+
+	for (std::deque<Item>::iterator it = m_queue.begin(); it != m_queue.end(); ++it)
+	{
+		it->file->Lock();
+		it->file->setDefragmentQueued(false);
+		it->file->Unlock();
+		g_FileManager->Put(it->file);
+	}
+	m_queue.clear();
+	m_queued.clear();
+}
+
+void Defragmenter::push(CFile *file)
+{
+	push(file, time(NULL) + Idle);
+}
+
+void Defragmenter::push(CFile *file, time_t due)
+{
+	Lock lock(m_mutex);
+
+	if (!m_queued.insert(file).second)
+		return;
+
+	g_FileManager->Hold(file);
+
+	Item item;
+
+	item.file = file;
+	item.due = due;
+
+	m_queue.push_back(item);
+	m_cond.Signal();
+}
+
+void Defragmenter::cancel(CFile *file)
+{
+	{
+		Lock lock(m_mutex);
+
+		if (m_queued.erase(file) == 0)
+			return;
+
+		for (std::deque<Item>::iterator it = m_queue.begin(); it != m_queue.end(); ++it)
+		{
+			if (it->file == file)
+			{
+				m_queue.erase(it);
+				break;
+			}
+		}
+	}
+
+	// The caller holds the file as well, this is
+	// never the last reference.
+
+	g_FileManager->Put(file);
+}
@@ -0,0 +1,128 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEFRAGMENTER_HPP
+#define DEFRAGMENTER_HPP
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <deque>
+#include <set>
+
+#include "Mutex.hpp"
+#include "Condition.hpp"
+
+class CFile;
+
+/**
+ * Thread that defragments files in the background. Files are queued
+ * when their lower files grow too big (see Compress::isFragmented())
+ * and they are defragmented when nobody has written to them for
+ * a while. A file is locked only while a part of it is processed,
+ * the amount of data processed per second may be limited.
+ *
+ * Queued files are held in the g_FileManager so they follow renames,
+ * files unlinked meanwhile are dropped from the queue by cancel().
+ */
+class Defragmenter
+{
+	struct Item
+	{
+		CFile		*file;
+		time_t		 due;
+	};
+
+	std::deque<Item>	m_queue;
+	std::set<CFile *>	m_queued;
+
+	pthread_t	m_thread;
+	bool		m_running;
+	bool		m_stop;
+
+	// Bytes processed per second, zero means no limit.
+	//
+	size_t		m_rate;
+
+	// Protects m_queue, m_queued and m_stop.
+	//
+	Mutex		m_mutex;
+	Condition	m_cond;
+
+	static void *worker(void *arg);
+
+	void defragment(CFile *file);
+
+	/**
+	 * Queue the `file` to be defragmented at the time `due`.
+	 * The file is held until it's taken from the queue.
+	 */
+	void push(CFile *file, time_t due);
+
+	/**
+	 * Sleep for the time it takes to process `bytes` at the
+	 * m_rate. Returns false if the thread is being stopped.
+	 */
+	bool pause(off_t bytes);
+
+	Defragmenter(const Defragmenter &);		// No copy constructor
+	Defragmenter& operator=(const Defragmenter &);	// No assign operator
+public:
+	// Number of seconds a file must not be written to
+	// before it's defragmented.
+	//
+	static const unsigned int Idle = 5;
+
+	// Number of blocks (of g_BufferedMemorySize) processed
+	// with the file locked.
+	//
+	static const unsigned int Step = 16;
+
+	Defragmenter();
+	~Defragmenter();
+
+	void setRate(size_t rate) { m_rate = rate; }
+
+	/**
+	 * Start the thread. Must be called after the process
+	 * forked to the background.
+	 */
+	void start();
+
+	/**
+	 * Wait until the file being processed is finished, forget
+	 * the queued ones and stop the thread.
+	 */
+	void stop();
+
+	bool isRunning() const { return m_running; }
+
+	/**
+	 * Queue the `file` to be defragmented once it's idle.
+	 */
+	void push(CFile *file);
+
+	/**
+	 * Drop the `file` from the queue, called when its lower
+	 * file has been unlinked.
+	 */
+	void cancel(CFile *file);
+};
+
+#endif
+
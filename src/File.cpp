@@ -45,15 +45,15 @@ File::~File()
 	assert (m_fd == -1);
 }
 
-int File::getattr(const char *name, struct stat *st)
+int File::getattr(const char *name, struct stat *st, bool known)
 {
-	int r;
+	int r = 0;
 
 	m_name = name;
 
 	if (m_fd != -1)
 		r = ::fstat(m_fd, st);
-	else
+	else if (!known)
 		r = ::lstat(name, st);
 
 	return r;
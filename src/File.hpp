@@ -20,7 +20,7 @@
 #ifndef FILE_HPP
 #define FILE_HPP
 
-#include "Mutex.hpp"
+#include "RWLock.hpp"
 
 #include <sys/types.h>
 
@@ -48,7 +48,7 @@ protected:
 private:
 	// USED ONLY IN THIS CLASS PRIVATELY
 
-	Mutex m_mutex;
+	RWLock m_lock;
 
 	File(const File&);	// Private copy constructor.
 public:
@@ -57,14 +57,31 @@ public:
 	File(const struct stat *st, const char *name);
 	virtual ~File();
 
-	void Lock(void) { m_mutex.Lock(); }
-	void Unlock(void) { m_mutex.Unlock(); }
+	/**
+	 * Exclusive lock, taken by everything that
+	 * changes the file or the state of the object.
+	 */
+	void Lock(void) { m_lock.WriteLock(); }
+
+	/**
+	 * Shared lock, enough for read() that is const
+	 * and doesn't change the object.
+	 */
+	void LockShared(void) { m_lock.ReadLock(); }
+
+	void Unlock(void) { m_lock.Unlock(); }
 
 	ino_t getInode(void) const { return m_inode; }
 	void  setInode(ino_t inode) { m_inode = inode; }
 	std::string getName(void) const { return m_name; }
 
-	int getattr(const char *name, struct stat *st);
+	/**
+	 * Stat the file, the open file descriptor is used if there is one.
+	 *
+	 * @param known - the `st` already holds lstat(2) of the `name`,
+	 *                it's used if the file is not open.
+	 */
+	int getattr(const char *name, struct stat *st, bool known = false);
 
 	int unlink(const char *name);
 
@@ -28,15 +28,15 @@
 
 #include "FileManager.hpp"
 
-FileManager::FileManager()
+FileManager::FileManager() :
+	m_generation (0)
 {
 }
 
 FileManager::~FileManager()
 {
-	bool				 flag = false;
-	CFile				*file;
-	set<File *, ltFile>::iterator	 it = m_files.begin();
+	bool	 flag = false;
+	CFile	*file;
 
 	// FUSE should allow umount only when filesystem is not
 	// in use. Therefore if m_files is not empty and some files
@@ -44,70 +44,181 @@ FileManager::~FileManager()
 	// and have no responsibility for any damage
 	// when user hits CTRL+C.
 	//
-	while (it != m_files.end())
+	for (unsigned int i = 0; i < Shards; ++i)
 	{
-		file = dynamic_cast<CFile*> (*it);
-		
-		if ((file->m_crefs > 0) & !flag)
+		con_t::iterator it = m_shards[i].m_files.begin();
+
+		while (it != m_shards[i].m_files.end())
 		{
-			rError("FuseCompress killed while mounted with some opened files.");
-			flag = true;
+			file = it->second;
+
+			if ((file->m_crefs > 0) & !flag)
+			{
+				rError("FuseCompress killed while mounted with some opened files.");
+				flag = true;
+			}
+
+			m_shards[i].m_files.erase(it++);
+			delete file;
 		}
-		
-		m_files.erase(it++);
-		delete file;
+	}
+}
+
+FileManager::Shard& FileManager::lockShard(CFile *file)
+{
+	// The inode number of the file may be changed by Update()
+	// until the shard is locked.
+
+	while (true)
+	{
+		ino_t inode = file->getInode();
+		Shard &shard = getShard(inode);
+
+		shard.m_mutex.Lock();
+		if (file->getInode() == inode)
+			return shard;
+		shard.m_mutex.Unlock();
 	}
 }
 
 void FileManager::Put(CFile *file)
 {
-	m_mutex.Lock();
+	// Fast path, the file is still used by someone else
+	// so there is no need to lock the shard.
+
+	int crefs = __atomic_load_n(&file->m_crefs, __ATOMIC_RELAXED);
+
+	while (crefs > 1)
+	{
+		int old = __sync_val_compare_and_swap(&file->m_crefs, crefs, crefs - 1);
+		if (old == crefs)
+			return;
+		crefs = old;
+	}
 
-	file->m_crefs--;
+	Shard &shard = lockShard(file);
 
 	// TODO: Invent some policy to decide when and why to
 	// call delete file...
 	//
-	if (file->m_crefs < 1)
+	if (__sync_sub_and_fetch(&file->m_crefs, 1) < 1)
 	{
-		m_files.erase(file);
+		shard.m_files.erase(file->getInode());
 		delete file;
 	}
 
-	m_mutex.Unlock();
+	shard.m_mutex.Unlock();
 }
 
-void FileManager::GetUnlocked(CFile *file)
+void FileManager::Hold(CFile *file)
 {
-	file->m_crefs++;
+	// Nobody can drop the last reference meanwhile so
+	// the shard doesn't need to be locked.
+
+	int crefs = __sync_fetch_and_add(&file->m_crefs, 1);
+
+	assert(crefs > 0);
+}
+
+void FileManager::BeginUpdate()
+{
+	m_update.Lock();
+	__sync_fetch_and_add(&m_generation, 1);
 }
 
-void FileManager::UpdateUnlocked(CFile *file, ino_t inode)
+void FileManager::EndUpdate()
 {
-	m_files.erase(file);
+	__sync_fetch_and_add(&m_generation, 1);
+	m_update.Unlock();
+}
+
+void FileManager::Update(CFile *file, ino_t inode)
+{
+	assert(m_generation & 1);
+
+	Shard &from = lockShard(file);
+	Shard &to = getShard(inode);
+
+	// Lock shards in the order of their addresses to
+	// avoid a deadlock with another thread.
+
+	if (&to != &from)
+	{
+		if (&to < &from)
+		{
+			from.m_mutex.Unlock();
+			to.m_mutex.Lock();
+			from.m_mutex.Lock();
+		}
+		else
+			to.m_mutex.Lock();
+	}
+
+	from.m_files.erase(file->getInode());
 	file->setInode(inode);
-	m_files.insert(file);
+	to.m_files[inode] = file;
+
+	if (&to != &from)
+		to.m_mutex.Unlock();
+	from.m_mutex.Unlock();
 }
 
 CFile *FileManager::Get(const char *name, bool create)
 {
-	Lock();
-	CFile *file = GetUnlocked(name, create);
-	Unlock();
+	CFile *file;
 
+	while ((file = find(name, NULL, create, getGeneration())) == (CFile *) -1)
+		;
 	return file;
 }
 
-CFile *FileManager::GetUnlocked(const char *name, bool create)
+CFile *FileManager::Get(const char *name, struct stat *st, bool create)
 {
-	struct stat			 st;
-	CFile				*file = NULL;
-	set<File *, ltFile>::iterator	 it;
+	CFile *file;
+
+	while ((file = find(name, st, create, getGeneration())) == (CFile *) -1)
+		;
+	return file;
+}
+
+/**
+ * Returns (CFile *) -1 if the lookup has to be repeated, because
+ * the `generation` has changed.
+ */
+CFile *FileManager::find(const char *name, struct stat *lst, bool create, unsigned long generation)
+{
+	struct stat	 st;
+	CFile		*file = NULL;
+
+	if (generation & 1)
+	{
+		// Wait for the update to finish.
+
+		m_update.Lock();
+		m_update.Unlock();
+		return (CFile *) -1;
+	}
+
+	if (lst)
+	{
+		// The caller wants the stat of the name itself,
+		// symbolic links are not followed.
+
+		if (lstat(name, lst) == -1)
+			return NULL;
+
+		if (S_ISLNK(lst->st_mode))
+		{
+			errno = 0;
+			return NULL;
+		}
+		st = *lst;
+	}
 
 	// Get inode number from the name. If 'name' is symbolic link,
 	// retrieve inode number of the file it points to.
 	// 
-	if (stat(name, &st) == -1)
+	else if (stat(name, &st) == -1)
 	{
 		if ((errno != ENOENT) && (errno != ELOOP))
 		{
@@ -135,22 +246,34 @@ CFile *FileManager::GetUnlocked(const char *name, bool create)
 		st.st_size = 0;
 	}
 
-	File search(&st, name);
-	
-	it = m_files.find(&search);
+	Shard &shard = getShard(st.st_ino);
+
+	shard.m_mutex.Lock();
+
+	if (getGeneration() != generation)
+	{
+		// The name may point to another inode now.
+
+		shard.m_mutex.Unlock();
+		return (CFile *) -1;
+	}
+
+	con_t::iterator it = shard.m_files.find(st.st_ino);
 	
-	if (it != m_files.end())
+	if (it != shard.m_files.end())
 	{
-		file = dynamic_cast<CFile*> (*it);
-		
-		if (create)
-		{
-			file->m_crefs++;
-		}
+		file = it->second;
+
+		__sync_fetch_and_add(&file->m_crefs, 1);
 	}
 	else
 		if (create)
 		{
+			// Constructor of the CFile reads the file header,
+			// do not block other files of the shard meanwhile.
+
+			shard.m_mutex.Unlock();
+
 			rDebug("new CFile(..., %s)", name);
 
 			file = new (std::nothrow) CFile(&st, name);
@@ -161,9 +284,22 @@ CFile *FileManager::GetUnlocked(const char *name, bool create)
 				abort();
 			}
 
-			m_files.insert(file);
+			shard.m_mutex.Lock();
+
+			if ((getGeneration() != generation) ||
+			    (shard.m_files.find(st.st_ino) != shard.m_files.end()))
+			{
+				// Someone else has been faster.
+
+				shard.m_mutex.Unlock();
+				delete file;
+				return (CFile *) -1;
+			}
+
+			shard.m_files[st.st_ino] = file;
 		}
 
+	shard.m_mutex.Unlock();
+
 	return file;
 }
-
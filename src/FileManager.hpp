@@ -23,8 +23,7 @@
 #include <sys/types.h>
 #include <pthread.h>
 
-#include <set>
-#include <map>
+#include <boost/unordered_map.hpp>
 
 #include "Memory.hpp"
 #include "Compress.hpp"
@@ -37,7 +36,8 @@ typedef Memory PARENT_CFILE;
 
 /**
  * Helper class that's only goal is to remember how many users currently
- * use it. m_cref counter is protected with mutex in FileManager class.
+ * use it. m_crefs counter is changed atomically, it is increased only
+ * with the shard of the FileManager that contains the file locked.
  */
 class CFile : public PARENT_CFILE
 {
@@ -65,32 +65,58 @@ public:
 
 class FileManager
 {
+	typedef boost::unordered_map<ino_t, CFile *> con_t;
+
 	/**
-	 * Using struct instead of class only because its
-	 * default access is public.
+	 * Part of the database, files are spread over
+	 * the shards according to their inode numbers.
 	 */
-	struct ltFile
+	struct Shard
 	{
-		bool operator()(const File *file1, const File *file2) const
-		{
-			return (file1->getInode() < file2->getInode());
-		}
+		con_t	m_files;
+
+		/**
+		 * Protects m_files.
+		 */
+		Mutex	m_mutex;
 	};
-	
-	set<File *, ltFile> m_files;
+
+	static const unsigned int Shards = 64;
+
+	Shard m_shards[Shards];
+
+	/**
+	 * Odd while an update that changes the mapping of names
+	 * to inode numbers is in progress. Get() repeats the lookup
+	 * if the value changes while it looks for a file.
+	 */
+	unsigned long m_generation;
 
 	/**
-	 * Protects m_files and every m_refs in CFile type instancies
+	 * Serializes updates.
 	 */
-	Mutex m_mutex;
+	Mutex m_update;
+
+	Shard& getShard(ino_t inode) { return m_shards[inode % Shards]; }
+
+	/**
+	 * Lock the shard that contains the `file`.
+	 */
+	Shard& lockShard(CFile *file);
+
+	unsigned long getGeneration() const
+	{
+		return __atomic_load_n(&m_generation, __ATOMIC_ACQUIRE);
+	}
 
+	CFile *find(const char *name, struct stat *lst, bool create, unsigned long generation);
+
+	FileManager(const FileManager &);		// No copy constructor
+	FileManager& operator=(const FileManager &);	// No assign operator
 public:
 	FileManager();
 	~FileManager();
 
-	void Lock() { m_mutex.Lock(); }
-	void Unlock() { m_mutex.Unlock(); }
-	
 	/**
 	 * Returns pointer to CFile instance that does all operations on
 	 * the requested name. It works even with hardlinks because name
@@ -99,21 +125,45 @@ public:
 	 * @param name
 	 * @param create - if true, a new instance is created (with reference
 	 *                          counter set to one) if there is no
-	 *                          one in the database (set m_files). If there
+	 *                          one in the database. If there
 	 *                          is one, it's reference counter is increased.
 	 *                          
 	 *                 if false, returns a null if there is no one in
 	 *                           the database. If there is one, it's reference
-	 *                           counter is not increased.
+	 *                           counter is increased.
 	 */
 	CFile *Get(const char *name, bool create = true);
-	CFile *GetUnlocked(const char *name, bool create = true);
 
-	void   GetUnlocked(CFile *file);
+	/**
+	 * The same as Get(name, create), but the name is looked up by
+	 * lstat(2) and the result is stored to the `st`, so the caller
+	 * doesn't have to walk the path again. Returns a null with
+	 * errno set to zero for a symbolic link.
+	 */
+	CFile *Get(const char *name, struct stat *st, bool create = true);
+
 	void   Put(CFile *file);
 
-	void   UpdateUnlocked(CFile *file, ino_t inode);
+	/**
+	 * Take another reference to the `file` without a lookup.
+	 * The caller must know the file is used by someone else
+	 * until the function returns.
+	 */
+	void   Hold(CFile *file);
+
+	/**
+	 * Updates that rename lower files must be enclosed by
+	 * BeginUpdate() and EndUpdate(). Get() must not be called
+	 * between them by the same thread.
+	 */
+	void   BeginUpdate();
+	void   EndUpdate();
+
+	/**
+	 * Change the inode number of the `file`. Must be called
+	 * between BeginUpdate() and EndUpdate().
+	 */
+	void   Update(CFile *file, ino_t inode);
 };
 
 #endif
-
@@ -17,15 +17,25 @@
     along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "config.h"
+
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #include <cassert>
+#include <cstring>
+#include <algorithm>
 #include <boost/scoped_array.hpp>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZERO_SCAN_X86
+#include <immintrin.h>
+#endif
+
 #include "FileUtils.hpp"
 
 int FileUtils::force(const char *name, const struct stat &buf)
@@ -107,12 +117,236 @@ bool FileUtils::copy(int source, int dest)
 	return true;
 }
 
-bool FileUtils::isZeroOnly(const char *buf, size_t size)
+bool FileUtils::writeAll(int fd, const char *buf, size_t size, off_t offset)
 {
-	for (size_t i = 0; i < size; ++i, ++buf)
-		if (*buf != 0)
+	while (size > 0)
+	{
+		ssize_t bytesWritten = ::pwrite(fd, buf, size, offset);
+		if (bytesWritten == -1)
+		{
+			if (errno == EINTR)
+				continue;
 			return false;
+		}
+
+		size -= bytesWritten;
+		buf += bytesWritten;
+		offset += bytesWritten;
+	}
 	return true;
 }
 
+bool FileUtils::copyRange(int source, off_t sourceOffset, int dest, off_t destOffset, size_t size)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	while (size > 0)
+	{
+		loff_t in = sourceOffset;
+		loff_t out = destOffset;
+
+		ssize_t bytesCopied = ::copy_file_range(source, &in, dest, &out, size, 0);
+		if (bytesCopied == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			// Files are on different file systems or the file
+			// system doesn't support it, copy them the old way.
+
+			if ((errno == EXDEV) || (errno == ENOSYS) ||
+			    (errno == EINVAL) || (errno == EOPNOTSUPP))
+				break;
+			return false;
+		}
+		if (bytesCopied == 0)
+			break;
+
+		size -= bytesCopied;
+		sourceOffset += bytesCopied;
+		destOffset += bytesCopied;
+	}
+	if (size == 0)
+		return true;
+#endif
+	size_t length = std::min(size, (size_t) 100 * 1024);
+
+	boost::scoped_array<char> buffer(new char[length]);
+
+	while (size > 0)
+	{
+		ssize_t bytesRead = ::pread(source, buffer.get(), std::min(size, length), sourceOffset);
+		if (bytesRead == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (bytesRead == 0)
+		{
+			// The source file is shorter than expected.
+
+			errno = EIO;
+			return false;
+		}
+
+		if (!writeAll(dest, buffer.get(), bytesRead, destOffset))
+			return false;
+
+		size -= bytesRead;
+		sourceOffset += bytesRead;
+		destOffset += bytesRead;
+	}
+	return true;
+}
+
+typedef unsigned long word_t;
+
+size_t FileUtils::zeroPrefixWords(const char *buf, size_t size)
+{
+	size_t i = 0;
+
+	// Compare single bytes until the words are aligned.
+
+	for (; (i < size) && ((uintptr_t) (buf + i) % sizeof(word_t)); ++i)
+		if (buf[i] != 0)
+			return i;
+
+	for (; i + sizeof(word_t) <= size; i += sizeof(word_t))
+	{
+		word_t w;
+
+		memcpy(&w, buf + i, sizeof(w));
+		if (w != 0)
+			break;
+	}
+
+	for (; i < size; ++i)
+		if (buf[i] != 0)
+			break;
+	return i;
+}
+
+size_t FileUtils::zeroSuffixWords(const char *buf, size_t size)
+{
+	size_t i = size;
+
+	for (; (i > 0) && ((uintptr_t) (buf + i) % sizeof(word_t)); --i)
+		if (buf[i - 1] != 0)
+			return size - i;
+
+	for (; i >= sizeof(word_t); i -= sizeof(word_t))
+	{
+		word_t w;
+
+		memcpy(&w, buf + i - sizeof(word_t), sizeof(w));
+		if (w != 0)
+			break;
+	}
+
+	for (; i > 0; --i)
+		if (buf[i - 1] != 0)
+			break;
+	return size - i;
+}
+
+#ifdef ZERO_SCAN_X86
+
+// The vector versions skip whole zero blocks of 64 (SSE2) or 128
+// (AVX2) bytes, the block with the first non-zero byte is finished
+// by the word version.
+
+__attribute__((target("sse2")))
+static bool isZeroBlockSSE2(const char *buf)
+{
+	const __m128i *p = reinterpret_cast<const __m128i *> (buf);
+
+	__m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+	                         _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff;
+}
+
+__attribute__((target("avx2")))
+static bool isZeroBlockAVX2(const char *buf)
+{
+	const __m256i *p = reinterpret_cast<const __m256i *> (buf);
+
+	__m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+	                            _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+
+	return _mm256_testz_si256(v, v);
+}
+
+template<bool (*isZeroBlock)(const char *), size_t Block>
+static size_t zeroPrefixVector(const char *buf, size_t size)
+{
+	size_t i = 0;
+
+	for (; i + Block <= size; i += Block)
+		if (!isZeroBlock(buf + i))
+			break;
+	return i + FileUtils::zeroPrefixWords(buf + i, size - i);
+}
+
+template<bool (*isZeroBlock)(const char *), size_t Block>
+static size_t zeroSuffixVector(const char *buf, size_t size)
+{
+	size_t i = size;
+
+	for (; i >= Block; i -= Block)
+		if (!isZeroBlock(buf + i - Block))
+			break;
+	return (size - i) + FileUtils::zeroSuffixWords(buf, i);
+}
+
+#endif
+
+size_t FileUtils::zeroPrefix(const char *buf, size_t size)
+{
+#ifdef ZERO_SCAN_X86
+	if (__builtin_cpu_supports("avx2"))
+		return zeroPrefixVector<isZeroBlockAVX2, 128>(buf, size);
+	if (__builtin_cpu_supports("sse2"))
+		return zeroPrefixVector<isZeroBlockSSE2, 64>(buf, size);
+#endif
+	return zeroPrefixWords(buf, size);
+}
+
+size_t FileUtils::zeroSuffix(const char *buf, size_t size)
+{
+#ifdef ZERO_SCAN_X86
+	if (__builtin_cpu_supports("avx2"))
+		return zeroSuffixVector<isZeroBlockAVX2, 128>(buf, size);
+	if (__builtin_cpu_supports("sse2"))
+		return zeroSuffixVector<isZeroBlockSSE2, 64>(buf, size);
+#endif
+	return zeroSuffixWords(buf, size);
+}
+
+bool FileUtils::isZeroOnly(const char *buf, size_t size)
+{
+	return zeroPrefix(buf, size) == size;
+}
+
+size_t FileUtils::findHole(const char *buf, size_t size, off_t offset, size_t minimum, size_t &start)
+{
+	size_t pos = 0;
+
+	while (pos < size)
+	{
+		size_t next = std::min(size, pos + minimum - (size_t) ((offset + pos) % minimum));
+
+		if ((next - pos == minimum) && isZeroOnly(buf + pos, minimum))
+		{
+			// Zeros in front of the chunk are left with the data,
+			// the run goes on behind it as far as the zeros do.
+
+			start = pos;
+			return zeroPrefix(buf + pos, size - pos);
+		}
+		pos = next;
+	}
+	return 0;
+}
+
 
@@ -17,6 +17,7 @@
     along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/types.h>
 #include <sys/stat.h>
 
 class FileUtils
@@ -38,6 +39,44 @@ public:
 
 	static bool copy(int source, int dest);
 
+	/*
+	 * Write the whole buffer to the file at the offset,
+	 * doesn't change the file offset.
+	 */
+	static bool writeAll(int fd, const char *buf, size_t size, off_t offset);
+
+	/*
+	 * Copy `size` bytes from the `sourceOffset` of the `source` file
+	 * to the `destOffset` of the `dest` file, doesn't change the file
+	 * offsets. The kernel copies the data if it supports it,
+	 * otherwise it's read and written.
+	 */
+	static bool copyRange(int source, off_t sourceOffset, int dest, off_t destOffset, size_t size);
+
+	/*
+	 * Number of zero bytes the buffer starts (zeroPrefix) or
+	 * ends (zeroSuffix) with. Vector instructions are used if
+	 * the processor supports them.
+	 */
+	static size_t zeroPrefix(const char *buf, size_t size);
+	static size_t zeroSuffix(const char *buf, size_t size);
+
+	/*
+	 * The same without vector instructions, they compare
+	 * single words.
+	 */
+	static size_t zeroPrefixWords(const char *buf, size_t size);
+	static size_t zeroSuffixWords(const char *buf, size_t size);
+
 	static bool isZeroOnly(const char *buf, size_t size);
+
+	/*
+	 * Find the first run of zeros in the buffer that covers a whole
+	 * chunk of `minimum` bytes aligned to the offsets of the file,
+	 * the buffer is stored at the `offset` of the file. Returns the
+	 * length of the run (zero if there is none) and its start
+	 * in the `start`.
+	 */
+	static size_t findHole(const char *buf, size_t size, off_t offset, size_t minimum, size_t &start);
 };
 
@@ -23,10 +23,10 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <string.h>
-#include <sched.h>
 #include <errno.h>
 #include <cstdlib>
 #include <iostream>
+#include <sstream>
 #if defined(HAVE_ATTR_XATTR_H)
 #  include <attr/xattr.h>
 #elif defined(HAVE_SYS_XATTR_H)
@@ -38,10 +38,22 @@
 
 #include "FuseCompress.hpp"
 #include "FileManager.hpp"
+#include "BlockCache.hpp"
+#include "ThreadPool.hpp"
+#include "Defragmenter.hpp"
+#include "WriteBack.hpp"
+#include "Statistics.hpp"
 
 extern bool         g_DebugMode;
 extern std::string  g_dirLower;
 extern std::string  g_dirMount;
+extern BlockCache   g_BlockCache;
+extern ThreadPool   g_ThreadPool;
+extern Defragmenter g_Defragmenter;
+extern WriteBack    g_WriteBack;
+extern unsigned int g_ReadAhead;
+extern unsigned int g_Threads;
+extern Statistics   g_Statistics;
 static DIR         *g_Dir;
 FileManager        *g_FileManager;
 
@@ -65,6 +77,9 @@ FuseCompress::FuseCompress()
 	m_ops.chmod = FuseCompress::chmod;
 	m_ops.chown = FuseCompress::chown;
 	m_ops.truncate = FuseCompress::truncate;
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_FALLOCATE
+	m_ops.fallocate = FuseCompress::fallocate;
+#endif
 	m_ops.utimens = FuseCompress::utimens;
 	m_ops.open = FuseCompress::open;
 	m_ops.read = FuseCompress::read;
@@ -110,13 +125,46 @@ void *FuseCompress::init(struct fuse_conn_info *conn)
 		rError("No memory to allocate object of FileManager class");
 		abort();
 	}
+
+	// Threads must be started here, fuse_main() may have forked
+	// the process to the background.
+
+	unsigned int threads = g_Threads;
+
+	if (threads == 0)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = cpus > 0 ? cpus : 1;
+	}
+
+	// Blocks are compressed in parallel only if there are more
+	// threads, a single one would just add overhead.
+
+	if ((threads > 1) || (g_ReadAhead > 0))
+		g_ThreadPool.start(threads);
+
+	g_Defragmenter.start();
+	g_WriteBack.start();
 	
 	return NULL;
 }
 
 void FuseCompress::destroy(void *data)
 {
+	g_WriteBack.stop();
+	g_Defragmenter.stop();
+	g_ThreadPool.stop();
+
 	delete g_FileManager;
+
+	std::ostringstream stats;
+	stats << g_BlockCache;
+	rDebug("Block %s", stats.str().c_str());
+
+	std::ostringstream latencies;
+	latencies << g_Statistics;
+	rDebug("Latencies:\n%s", latencies.str().c_str());
 }
 
 const char *FuseCompress::getpath(const char *path)
@@ -151,28 +199,28 @@ int FuseCompress::getattr(const char *name, struct stat *st)
 {
 	int	 r = 0;
 	CFile	*file;
+	StatisticsTimer timer(g_Statistics, Statistics::GETATTR);
 
 	name = getpath(name);
 
-	r = ::lstat(name, st);
-
 	// Speed optimization: Fast path for '.' questions.
 	//
 	if ((name[0] == '.') && (name[1] == '\0'))
-		return 0;
+		return (::lstat(name, st) == -1) ? -errno : 0;
 
-	// For symbolic links it's ok to stop here.
+	// The lookup stats the name for us. For symbolic links
+	// it's ok to stop here (errno is zero then).
 	// 
-	if (S_ISLNK(st->st_mode))
-		return 0;
-	
-	file = g_FileManager->Get(name);
+	file = g_FileManager->Get(name, st);
 	if (!file)
 		return -errno;
 
 	file->Lock();
 	
-	if (file->getattr(name, st) == -1)
+	// The lookup stat is reused unless the lower file is open, Memory
+	// and Compress only adjust the size.
+
+	if (file->getattr(name, st, true) == -1)
 		r = -errno;
 
 	file->Unlock();
@@ -280,21 +328,15 @@ int FuseCompress::unlink(const char *path)
 	path = getpath(path);
 	rDebug("FuseCompress::unlink %s", path);
 
-	g_FileManager->Lock();
-
-	file = g_FileManager->GetUnlocked(path, false);
+	file = g_FileManager->Get(path, false);
 	if (!file)
 	{
 		if (::unlink(path) == -1)
 			r = -errno;
 
-		g_FileManager->Unlock();
 		return r;
 	}
 
-	g_FileManager->GetUnlocked(file);
-	g_FileManager->Unlock();
-
 	file->Lock();
 	
 	if (file->unlink(path) == -1)
@@ -302,6 +344,12 @@ int FuseCompress::unlink(const char *path)
 	
 	file->Unlock();
 
+	// The inode of the lower file may be reused by
+	// another file, don't keep the file held.
+
+	if (r == 0)
+		g_Defragmenter.cancel(file);
+
 	g_FileManager->Put(file);
 
 	return r;
@@ -387,10 +435,14 @@ int FuseCompress::rename(const char *from, const char *to)
 	to = getpath(to);
 	rDebug("FuseCompress::rename from: %s, to: %s", from, to);
 
-	g_FileManager->Lock();
-	
-	file_from = g_FileManager->GetUnlocked(from, false);
-	file_to = g_FileManager->GetUnlocked(to, false);
+	file_from = g_FileManager->Get(from, false);
+	file_to = g_FileManager->Get(to, false);
+
+	// Names are going to point to different inodes, lookups
+	// in the g_FileManager have to wait until we are done.
+	//
+	g_FileManager->BeginUpdate();
+
 	if (file_to)
 	{
 		// This is most important command. We need to delete cached
@@ -405,6 +457,7 @@ int FuseCompress::rename(const char *from, const char *to)
 			r = -errno;
 			goto error;
 		}
+		g_Defragmenter.cancel(file_to);
 	}
 
 	// Rename file 'from' to file 'to'. This changes name of the inode file_from.
@@ -425,7 +478,12 @@ int FuseCompress::rename(const char *from, const char *to)
 		file_from->Unlock();
 	}
 error:
-	g_FileManager->Unlock();
+	g_FileManager->EndUpdate();
+
+	if (file_to)
+		g_FileManager->Put(file_to);
+	if (file_from)
+		g_FileManager->Put(file_from);
 	return r;
 }
 
@@ -464,6 +522,7 @@ int FuseCompress::truncate(const char *name, off_t size)
 {
 	int	 r = 0;
 	CFile	*file;
+	StatisticsTimer timer(g_Statistics, Statistics::TRUNCATE);
 
 	name = getpath(name);
 	rDebug("FuseCompress::truncate file %s, to size: %llx", name,
@@ -485,6 +544,27 @@ int FuseCompress::truncate(const char *name, off_t size)
 	return r;
 }
 
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_FALLOCATE
+int FuseCompress::fallocate(const char *name, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	int	 r = 0;
+	CFile	*file = reinterpret_cast<CFile *> (fi->fh);
+
+	name = getpath(name);
+	rDebug("FuseCompress::fallocate %p name: %s, mode: 0x%x, offset: 0x%llx, length: 0x%llx",
+			(void *) file, name, mode, (long long int) offset, (long long int) length);
+
+	file->Lock();
+
+	if (file->fallocate(name, mode, offset, length) == -1)
+		r = -errno;
+
+	file->Unlock();
+
+	return r;
+}
+#endif
+
 int FuseCompress::utimens(const char *name, const struct timespec tv[2])
 {
 	int	 r = 0;
@@ -492,21 +572,15 @@ int FuseCompress::utimens(const char *name, const struct timespec tv[2])
 
 	name = getpath(name);
 
-	g_FileManager->Lock();
-
-	file = g_FileManager->GetUnlocked(name, false);
+	file = g_FileManager->Get(name, false);
 	if (!file)
 	{
 		if (::utimensat(AT_FDCWD, name, tv, AT_SYMLINK_NOFOLLOW) == -1)
 			r = -errno;
 
-		g_FileManager->Unlock();
 		return r;
 	}
 
-	g_FileManager->GetUnlocked(file);
-	g_FileManager->Unlock();
-
 	file->Lock();
 	
 	if (file->utimens(name, tv) == -1)
@@ -529,6 +603,7 @@ int FuseCompress::open(const char *name, struct fuse_file_info *fi)
 {
 	int	 r = 0;
 	CFile	*file;
+	StatisticsTimer timer(g_Statistics, Statistics::OPEN);
 	
 	name = getpath(name);
 
@@ -567,11 +642,14 @@ int FuseCompress::read(const char *name, char *buf, size_t size, off_t offset, s
 {
 	int	 r;
 	CFile	*file = reinterpret_cast<CFile *> (fi->fh);
+	StatisticsTimer timer(g_Statistics, Statistics::READ);
 
 	rDebug("FuseCompress::read(B) %p name: %s, size: 0x%x, offset: 0x%llx",
 			(void *) file, getpath(name), (unsigned int) size, (long long int) offset);
 
-	file->Lock();
+	// Reads of the same file may run in parallel.
+	//
+	file->LockShared();
 	
 	r = file->read(buf, size, offset);
 	if (r == -1)
@@ -582,8 +660,6 @@ int FuseCompress::read(const char *name, char *buf, size_t size, off_t offset, s
 	rDebug("FuseCompress::read(E) %p name: %s, size: 0x%x, offset: 0x%llx, returned: 0x%x",
 			(void *) file, getpath(name), (unsigned int) size, (long long int) offset, r);
 
-	sched_yield();
-
 	return r;
 }
 
@@ -591,6 +667,7 @@ int FuseCompress::write(const char *name, const char *buf, size_t size, off_t of
 {
 	int	 r;
 	CFile	*file = reinterpret_cast<CFile *> (fi->fh);
+	StatisticsTimer timer(g_Statistics, Statistics::WRITE);
 
 	rDebug("FuseCompress::write %p name: %s, size: 0x%x, offset: 0x%llx",
 			(void *) file, getpath(name), (unsigned int) size, (long long int) offset);
@@ -603,8 +680,6 @@ int FuseCompress::write(const char *name, const char *buf, size_t size, off_t of
 
 	file->Unlock();
 
-	sched_yield();
-
 	return r;
 }
 
@@ -657,6 +732,7 @@ int FuseCompress::release(const char *name, struct fuse_file_info *fi)
 {
 	int	 r = 0;
 	CFile	*file = reinterpret_cast<CFile *> (fi->fh);
+	StatisticsTimer timer(g_Statistics, Statistics::RELEASE);
 
 	name = getpath(name);
 	rDebug("FuseCompress::release %p name: %s", (void *) file, name);
@@ -695,10 +771,37 @@ int FuseCompress::setxattr(const char *path, const char *name, const char *value
 	return 0;
 }
 
+/**
+ * Copy the statistics to the value of the virtual extended attribute.
+ */
+static int getStatistics(char *value, size_t size)
+{
+	std::ostringstream os;
+
+	os << g_Statistics << g_BlockCache << std::endl;
+
+	std::string stats = os.str();
+
+	if (size == 0)
+		return stats.size();
+	if (size < stats.size())
+		return -ERANGE;
+
+	memcpy(value, stats.data(), stats.size());
+	return stats.size();
+}
+
 int FuseCompress::getxattr(const char *path, const char *name, char *value, size_t size)
 {
 	path = getpath(path);
 
+	// Statistics are provided as an extended attribute of
+	// the mount point. It's not listed by listxattr, tools
+	// that copy extended attributes would copy it otherwise.
+
+	if ((path[0] == '.') && (path[1] == '\0') && (strcmp(name, "user.fusecompress.stats") == 0))
+		return getStatistics(value, size);
+
 	int r;
 	if (-1 == (r = ::lgetxattr(path, name, value, size)))
 		return -errno;
@@ -41,6 +41,9 @@ class FuseCompress
 	static int chmod (const char *, mode_t);
 	static int chown (const char *, uid_t, gid_t);
 	static int truncate (const char *, off_t);
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_FALLOCATE
+	static int fallocate (const char *, int, off_t, off_t, struct fuse_file_info *);
+#endif
 	static int utimens (const char *, const struct timespec tv[2]);
 	static int open (const char *, struct fuse_file_info *);
 	static int read (const char *, char *, size_t, off_t, struct fuse_file_info *);
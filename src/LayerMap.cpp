@@ -18,6 +18,8 @@
 */
 
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
 
 #include <boost/io/ios_state.hpp>
 
@@ -35,11 +37,29 @@ std::ostream &operator<<(std::ostream &os, const LayerMap &rLm)
 	os << "-- m_MaxLevel: 0x" << rLm.m_MaxLevel <<
 	      ", m_MaxLength: 0x" << rLm.m_MaxLength <<
 	      ", m_IsModified: " << rLm.m_IsModified <<
+	      ", m_Stored: 0x" << rLm.m_Stored <<
 	      " -------" << std::endl;
 
-	for (LayerMap::con_t::const_iterator it = rLm.m_Map.begin(); it != rLm.m_Map.end(); ++it)
+	if (rLm.m_Base)
 	{
-		os << **it << std::endl;
+		os << "-- m_Base: 0x" << rLm.m_Base->blocks() <<
+		      " blocks, m_BaseEnd: 0x" << rLm.m_BaseEnd << std::endl;
+
+		for (unsigned int i = 0; i < rLm.m_Base->blocks(); ++i)
+		{
+			Block bl;
+
+			if (rLm.m_Base->block(i, bl))
+				os << bl << std::endl;
+			else
+				os << "corrupted record 0x" << i << std::endl;
+		}
+		os << "--" << std::endl;
+	}
+
+	for (vector<LayerMap::Entry>::const_iterator it = rLm.m_Blocks.begin(); it != rLm.m_Blocks.end(); ++it)
+	{
+		os << rLm.block(*it) << std::endl;
 	}
 
 	os << "---------";
@@ -47,189 +67,502 @@ std::ostream &operator<<(std::ostream &os, const LayerMap &rLm)
 	return os;
 }
 
-void LayerMap::Put(Block *pBl, bool bKeepLevel)
+Block LayerMap::block(const Entry& e) const
 {
-//	cout << "Put Block: " << *pBl << " into following LayerMap:" << endl;
-//	cout << *this << endl;
+	Block bl(e.type);
+
+	bl.offset = e.offset;
+	bl.coffset = e.coffset;
+	bl.length = e.length;
+	bl.olength = e.olength;
+	bl.clength = e.clength;
+	bl.level = e.level;
+
+	if (e.type.isFramed())
+	{
+		bl.flength = e.flength;
+		bl.frames.assign(m_Frames.begin() + e.frames,
+		                 m_Frames.begin() + e.frames + frameCount(e));
+	}
+	return bl;
+}
+
+void LayerMap::append(const Block& rBl)
+{
+	Entry e;
+
+	e.offset = rBl.offset;
+	e.coffset = rBl.coffset;
+	e.length = rBl.length;
+	e.olength = rBl.olength;
+	e.clength = rBl.clength;
+	e.level = rBl.level;
+	e.type = rBl.type;
+	e.flength = 0;
+	e.frames = m_Frames.size();
+
+	if (rBl.type.isFramed())
+	{
+		e.flength = rBl.flength;
+		assert(rBl.frames.size() == frameCount(e));
+		m_Frames.insert(m_Frames.end(), rBl.frames.begin(), rBl.frames.end());
+	}
+	m_Blocks.push_back(e);
+}
+
+void LayerMap::Put(const Block &rBl, bool bKeepLevel)
+{
+	assert(rBl.length > 0);
+
+	// Blocks put on top of the base must be newer than the
+	// Blocks of the base.
+
+	if (bKeepLevel && m_Base && (rBl.level < m_Base->maxLevel()))
+		materialize();
 
-	assert(pBl->length > 0);
+	append(rBl);
+
+	Entry &e = m_Blocks.back();
 
 	// Preserve a level if already set.
 	//
 	if (!bKeepLevel)
 	{
-		pBl->level = m_MaxLevel++;
+		e.level = m_MaxLevel++;
 
 		// Check that m_MaxLevel didn't overrun.
 		//
 		assert(m_MaxLevel > 0);
 	}
-	con_t::iterator it = m_Map.insert(pBl);
-	if (m_MaxLength < pBl->length)
-		m_MaxLength = pBl->length;
+	if (m_MaxLength < e.length)
+		m_MaxLength = e.length;
 
-	m_IsModified = true;
+	putExtents(m_Blocks.size() - 1);
 
-//	cout << "State after Put: " << endl << *this << endl;
+	m_IsModified = true;
 }
 
 void LayerMap::Truncate(off_t offset)
 {
-//	std::cout << "Truncate following LayerMap to 0x" << std::hex << length << std::endl;
-//	std::cout << *this << std::endl;
+	// Nothing to do if all Blocks end before the offset. The last
+	// extent ends where the Blocks end.
+
+	off_t end = m_Extents.empty() ? 0 : (--m_Extents.end())->second.end;
+
+	if (max(end, m_BaseEnd) <= offset)
+		return;
 
-	con_t::iterator it = m_Map.begin();
+	// The base is never changed, only the part of it behind
+	// the m_BaseEnd is hidden.
 
-	while (it != m_Map.end())
+	if (m_BaseEnd > offset)
 	{
-		if ((*it)->offset >= offset)
-		{
-			delete (*it);
-			m_Map.erase(it++);
+		m_BaseEnd = offset;
+		if (m_BaseEnd == 0)
+			m_Base.reset();
+	}
+
+	// Extents behind the offset point to Blocks deleted below.
+
+	m_Extents.erase(m_Extents.lower_bound(offset), m_Extents.end());
+	if (!m_Extents.empty())
+	{
+		ext_t::iterator last = --m_Extents.end();
+
+		if (last->second.end > offset)
+			last->second.end = offset;
+	}
+
+	// Remove Blocks behind the offset, shorten the ones that cross
+	// it and move the remaining Blocks (and their frames) to close
+	// the gaps. The extents are then renumbered.
+
+	vector<unsigned int> index(m_Blocks.size());
+	unsigned int n = 0;
+	unsigned int stored = 0;
+	size_t nf = 0;
+
+	for (unsigned int i = 0; i < m_Blocks.size(); ++i)
+	{
+		Entry e = m_Blocks[i];
+
+		if (e.offset >= offset)
 			continue;
+		if (i < m_Stored)
+			stored++;
+		if (e.offset + (off_t) e.length > offset)
+		{
+			e.length = offset - e.offset;
+			assert(e.length > 0);
 		}
-		if ((*it)->offset + (off_t) (*it)->length > offset)
+		if (e.type.isFramed())
 		{
-			(*it)->length = offset - (*it)->offset;
-			assert((*it)->length > 0);
+			copy(m_Frames.begin() + e.frames,
+			     m_Frames.begin() + e.frames + frameCount(e),
+			     m_Frames.begin() + nf);
+			e.frames = nf;
+			nf += frameCount(e);
 		}
-		++it;
+		index[i] = n;
+		m_Blocks[n++] = e;
+	}
+
+	if (n == 0)
+	{
+		// Free allocated memory.
+
+		vector<Entry>().swap(m_Blocks);
+		vector<uint32_t>().swap(m_Frames);
+	}
+	else
+	{
+		m_Blocks.resize(n);
+		m_Frames.resize(nf);
 	}
 
+	for (ext_t::iterator it = m_Extents.begin(); it != m_Extents.end(); ++it)
+		it->second.block = index[it->second.block];
+
+	// Blocks added since the last store are kept shortened, the stored
+	// ones are truncated again when the journal is replayed.
+
+	m_Stored = stored;
+	if ((m_Truncated == -1) || (offset < m_Truncated))
+		m_Truncated = offset;
+
 	m_IsModified = true;
+}
 
-//	std::cout << "State after Truncate: " << std::endl << *this << std::endl;
+void LayerMap::setStored()
+{
+	m_Stored = m_Blocks.size();
+	m_Truncated = -1;
+	m_IsModified = false;
 }
 
-/* Find the biggest leveled Block with the higher offset and higher level than
- * current 'it' references to. */
-void LayerMap::next(off_t offset, con_t::const_iterator &it) const
+bool LayerMap::isJournalFull(unsigned int records, size_t blocks) const
 {
-	unsigned int level = (*it)->level;
+	return (records >= MaxJournalLength) || (2 * (blocks + changes()) > size());
+}
 
-	while (++it != m_Map.end())
+// Framing doesn't matter, see Compress::isCopyable().
+//
+static bool isSameMethod(const CompressionType& t1, const CompressionType& t2)
+{
+	return (t1.getType() & ~CompressionType::Framed) ==
+	       (t2.getType() & ~CompressionType::Framed);
+}
+
+bool LayerMap::isCompressedOnlyWith(CompressionType& type)
+{
+	if (m_Base)
 	{
-		if ((*it)->offset < offset)
+		for (unsigned int i = 0; i < m_Base->blocks(); ++i)
+		{
+			Block bl;
+
+			if (!m_Base->block(i, bl))
+				return false;
+
+			if ((bl.offset < m_BaseEnd) && !isSameMethod(bl.type, type) && !bl.type.isZero())
+				return false;
+		}
+	}
+	for (std::vector<Entry>::iterator it = m_Blocks.begin(); it != m_Blocks.end(); ++it)
+	{
+		if (isSameMethod(it->type, type) || it->type.isZero())
+		{
 			continue;
-		if ((*it)->level > level)
-			break;
+		}
+		return false;
 	}
+	return true;
+}
+
+void LayerMap::shortenBase(Block &rBl) const
+{
+	// Blocks crossing the m_BaseEnd are shortened the same
+	// way as Truncate() shortens the Blocks in the m_Blocks.
+
+	if ((rBl.offset < m_BaseEnd) && (rBl.offset + (off_t) rBl.length > m_BaseEnd))
+		rBl.length = m_BaseEnd - rBl.offset;
+}
+
+void LayerMap::setBase(const boost::shared_ptr<MappedIndex> &base)
+{
+	m_Blocks.clear();
+	m_Frames.clear();
+	m_Extents.clear();
+
+	m_Base = base;
+	m_BaseEnd = (base->extents() > 0) ? base->end(base->extents() - 1) : 0;
+
+	m_MaxLevel = base->maxLevel();
+	m_MaxLength = base->maxLength();
+
+	m_Previous = 0;
+	setStored();
 }
 
-/* Returns number of bytes that can be read from the offset from the Block specified by 'it' iterator. */
-unsigned int LayerMap::length(con_t::const_iterator &it, off_t offset) const
+void LayerMap::materialize()
 {
-	if ((*it)->offset > offset)
+	if (!m_Base)
+		return;
+
+	vector<Entry> blocks;
+	vector<uint32_t> frames;
+
+	blocks.swap(m_Blocks);
+	frames.swap(m_Frames);
+
+	// Blocks of the base go first as they are older.
+
+	for (unsigned int i = 0; i < m_Base->blocks(); ++i)
 	{
-		// Block starts after the offset, return 0 to
-		// indicate that.
-		//
-		return 0;
+		Block bl;
+
+		if (!m_Base->block(i, bl))
+		{
+			rError("LayerMap::materialize Corrupted record %u of the index", i);
+			continue;
+		}
+		shortenBase(bl);
+
+		if (bl.offset < m_BaseEnd)
+			append(bl);
 	}
 
-	con_t::const_iterator ni = it;
+	unsigned int n = m_Blocks.size();
+	size_t nf = m_Frames.size();
 
-	next(offset, ni);
+	for (vector<Entry>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+	{
+		it->frames += nf;
+		m_Blocks.push_back(*it);
+	}
+	m_Frames.insert(m_Frames.end(), frames.begin(), frames.end());
+
+	m_Stored += n;
+
+	m_Base.reset();
+	m_BaseEnd = 0;
+
+	rebuildExtents();
+}
 
-	assert((*it)->length >= 0);
-	if ((ni == m_Map.end()) || ((*it)->offset + (off_t) (*it)->length <= (*ni)->offset))
+void LayerMap::saveMapped(std::vector<char> &dest) const
+{
+	if (m_Base)
 	{
-		// 'it' block is not limited with 'no' block.
-		//
-		return (*it)->length - (offset - (*it)->offset);
+		LayerMap lm(*this);
+
+		lm.materialize();
+		lm.saveMapped(dest);
+		return;
 	}
-	else
+
+	size_t start = dest.size();
+
+	dest.resize(start + MappedIndex::size(m_Blocks.size(), m_Extents.size(), m_Frames.size()));
+
+	MappedIndex::Header *header = (MappedIndex::Header *) &dest[start];
+
+	memcpy(header->magic, MappedIndex::Magic, sizeof(header->magic));
+	header->maxLevel = m_MaxLevel;
+	header->maxLength = m_MaxLength;
+	header->blocks = m_Blocks.size();
+	header->extents = m_Extents.size();
+	header->frames = m_Frames.size();
+	header->reserved = 0;
+
+	MappedIndex::Record *r = (MappedIndex::Record *) (header + 1);
+
+	for (vector<Entry>::const_iterator it = m_Blocks.begin(); it != m_Blocks.end(); ++it, ++r)
 	{
-		return ((*ni)->offset - (*it)->offset) - (offset - (*it)->offset);
+		r->offset = it->offset;
+		r->coffset = it->coffset;
+		r->length = it->length;
+		r->olength = it->olength;
+		r->clength = it->clength;
+		r->level = it->level;
+		r->flength = it->flength;
+		r->frames = it->frames;
+		r->type = it->type.getType();
+		memset(r->reserved, 0, sizeof(r->reserved));
 	}
+
+	MappedIndex::Extent *e = (MappedIndex::Extent *) r;
+
+	for (ext_t::const_iterator it = m_Extents.begin(); it != m_Extents.end(); ++it, ++e)
+	{
+		e->start = it->first;
+		e->end = it->second.end;
+		e->block = it->second.block;
+		e->reserved = 0;
+	}
+
+	MappedIndex::le32_t *f = (MappedIndex::le32_t *) e;
+
+	for (vector<uint32_t>::const_iterator it = m_Frames.begin(); it != m_Frames.end(); ++it, ++f)
+		*f = *it;
 }
 
-void LayerMap::find(off_t offset, con_t::const_iterator &it) const
+void LayerMap::Apply(const LayerMap &rChanges)
 {
-	con_t::const_iterator si;
-	con_t::const_iterator ti;
+	if (rChanges.m_Truncated != -1)
+		Truncate(rChanges.m_Truncated);
 
-	it = m_Map.end();
+	for (vector<Entry>::const_iterator it = rChanges.m_Blocks.begin(); it != rChanges.m_Blocks.end(); ++it)
+		Put(rChanges.block(*it), true);
 
-	unsigned int level = 0;
+	m_MaxLevel = max(m_MaxLevel, rChanges.m_MaxLevel);
 
-	// We want to find a block which offset + length is bigger than offset.
-	//
-	// Thus we want to skip all blocks with offset + length smaller or
-	// equal to offset.
-	//
-	// This cannot be done in single call to stl algorithm, so we
-	// call lower_bound to skip all blocks with offset + m_MaxLength smaller
-	// or equal to offset. After that we simple iterate over all (if any)
-	// blocks wich offset + length is smaller or equal to offset.
+	setStored();
+}
+
+/* Split the extent that covers the offset to two extents, the second one starts at the offset. */
+void LayerMap::split(off_t offset)
+{
+	ext_t::iterator it = m_Extents.upper_bound(offset);
 
-	off_t offset_tmp = offset > m_MaxLength ? offset - m_MaxLength : 0;
-	Block block(offset_tmp, 0, m_MaxLevel);
+	if (it == m_Extents.begin())
+		return;
+	--it;
+	if ((it->first == offset) || (it->second.end <= offset))
+		return;
 
-	for (si = m_Map.lower_bound(&block); si != m_Map.end(); ++si)
-	{
-		assert((*si)->length >= 0);
-		if ((*si)->offset + (off_t) (*si)->length <= offset) {
-			continue;
-		}
+	Extent tail = { it->second.end, it->second.block };
+
+	it->second.end = offset;
+	m_Extents.insert(it, make_pair(offset, tail));
+}
+
+/* Make the Block visible in the extents where it has the highest level. */
+void LayerMap::putExtents(unsigned int index)
+{
+	const Entry &e = m_Blocks[index];
+
+	off_t start = e.offset;
+	off_t end = e.offset + (off_t) e.length;
+
+	// Every extent is then either inside or outside of the Block.
 
-		if ((*si)->level > level)
+	split(start);
+	split(end);
+
+	off_t pos = start;
+	ext_t::iterator it = m_Extents.lower_bound(start);
+
+	while (pos < end)
+	{
+		if ((it == m_Extents.end()) || (it->first > pos))
 		{
-			it = si;
-			level = (*si)->level;
-		}
+			// A hole not covered by any Block yet.
+
+			off_t hole = (it == m_Extents.end()) ? end : min(it->first, end);
+			Extent ext = { hole, index };
 
-		if ((*si)->offset > offset + m_MaxLength) {
-			return;
+			m_Extents.insert(it, make_pair(pos, ext));
+			pos = hole;
+			continue;
 		}
+		if (m_Blocks[it->second.block].level < e.level)
+			it->second.block = index;
+		pos = it->second.end;
+		++it;
+	}
 
-		for (ti = si; ti != m_Map.end(); ++ti)
-		{
-			if ((*ti)->offset > offset) {
-				return;
-			}
+	// Merge neighbouring extents of the same Block.
 
-			assert((*ti)->length >= 0);
-			if (((*ti)->offset + (off_t) (*ti)->length <= offset)) {
-				continue;
-			}
+	it = m_Extents.lower_bound(start);
+	if (it != m_Extents.begin())
+		--it;
+	while ((it != m_Extents.end()) && (it->first <= end))
+	{
+		ext_t::iterator ni = it;
 
-			if ((*ti)->level > level)
-			{
-				it = ti;
-				level = (*ti)->level;
-			}
+		if ((++ni != m_Extents.end()) &&
+		    (ni->first == it->second.end) && (ni->second.block == it->second.block))
+		{
+			it->second.end = ni->second.end;
+			m_Extents.erase(ni);
+			continue;
 		}
+		it = ni;
 	}
 }
 
+void LayerMap::rebuildExtents()
+{
+	m_Extents.clear();
+
+	for (unsigned int i = 0; i < m_Blocks.size(); ++i)
+		putExtents(i);
+}
+
 /* Returns Block that overlaps specified offset or higher offset */
 bool LayerMap::Get(off_t offset, Block &rBlock, off_t &rLength) const
 {
-//	std::cout << "State before Get called (looking offset: 0x" << hex << offset << ")" << std::endl << *this << std::endl;
+	ext_t::const_iterator it = m_Extents.upper_bound(offset);
 
-	con_t::const_iterator it;
+	// The extent before 'it' is the only one that may cover the offset.
 
-	find(offset, it);
+	if (it != m_Extents.begin())
+	{
+		ext_t::const_iterator pi = it;
 
-	if (it == m_Map.end()) {
-//		std::cout << "Get found nothing" << std::endl;
-		return false;
+		if ((--pi)->second.end > offset)
+		{
+			rBlock = block(m_Blocks[pi->second.block]);
+			rLength = pi->second.end - offset;
+			return true;
+		}
 	}
 
-	// Return found block to caller.
+	// Blocks of the base are visible up to the next extent.
+
+	off_t next = (it == m_Extents.end()) ? m_BaseEnd : min(it->first, m_BaseEnd);
 
-	rBlock = **it;
+	if (m_Base && (offset < next))
+	{
+		unsigned int i = m_Base->upperBound(offset);
+
+		if ((i > 0) && (m_Base->end(i - 1) > offset))
+		{
+			if (!m_Base->extentBlock(i - 1, rBlock))
+			{
+				errno = EIO;
+				return false;
+			}
+			shortenBase(rBlock);
+			rLength = min(m_Base->end(i - 1), next) - offset;
+			return true;
+		}
+		if ((i < m_Base->extents()) && (m_Base->start(i) < next))
+		{
+			// The offset is in a hole, return the Block behind it.
 
-//	std::cout << "Get found block: " << **it << std::endl;
+			if (!m_Base->extentBlock(i, rBlock))
+			{
+				errno = EIO;
+				return false;
+			}
+			shortenBase(rBlock);
+			rLength = 0;
+			return true;
+		}
+	}
 
-	// Compute the maximal length uses can read from the Block
-	// the 'it' iterator points to.
+	if (it == m_Extents.end())
+	{
+		errno = 0;
+		return false;
+	}
 
-	rLength = length(it, offset);
+	// The offset is in a hole, return the Block behind it.
 
-//	std::cout << "Get found block's length: 0x" << std::hex << rLength << std::endl;
+	rBlock = block(m_Blocks[it->second.block]);
+	rLength = 0;
 
 	return true;
 }
-
@@ -22,13 +22,20 @@
 
 #include <iostream>
 #include <climits>
+#include <map>
+#include <vector>
 
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
 #include <boost/serialization/serialization.hpp>
 #include <boost/serialization/set.hpp>
+#include <boost/serialization/split_member.hpp>
 #include <boost/serialization/tracking.hpp>
 #include <boost/serialization/version.hpp>
 
 #include "Block.hpp"
+#include "MappedIndex.hpp"
 
 class LayerMap
 {
@@ -53,88 +60,305 @@ private:
 			return (pB1->level > pB2->level);
 		}
 	};
+
+	// Container of Blocks in the layer maps of version 0,
+	// used only to load them.
+	//
 	typedef std::multiset<Block *, ltComp> con_t;
 
-	con_t        m_Map;
-	unsigned int m_MaxLevel;
-	unsigned int m_MaxLength;
-	bool         m_IsModified;
+	// Compact copy of a Block, see the Block for the meaning of the
+	// fields. Lengths of Blocks fit to 32 bits (see fc_b). Compressed
+	// offsets of frames of a framed Block are stored in the m_Frames
+	// starting at the index `frames`.
+	//
+	struct Entry
+	{
+		off_t            offset;
+		off_t            coffset;
+		uint32_t         length;
+		uint32_t         olength;
+		uint32_t         clength;
+		uint32_t         level;
+		uint32_t         flength;
+		uint32_t         frames;
+		CompressionType  type;
+	};
+
+	// Part of the file covered by the Block with the highest level.
+	//
+	struct Extent
+	{
+		off_t        end;
+		unsigned int block;	// Index to the m_Blocks.
+	};
+
+	// Resolved view of the m_Blocks: non-overlapping extents keyed
+	// by their start offsets. Neighbouring extents never point
+	// to the same Block, so an extent is the longest run of bytes
+	// that can be read from its Block.
+	//
+	typedef std::map<off_t, Extent> ext_t;
+
+	std::vector<Entry>    m_Blocks;
+	std::vector<uint32_t> m_Frames;
+	ext_t                 m_Extents;
+	unsigned int          m_MaxLevel;
+	unsigned int          m_MaxLength;
+	bool                  m_IsModified;
+
+	// Journal of the changes. The first m_Stored Blocks are already
+	// stored in the file, m_Truncated is the lowest offset the map
+	// has been truncated to since then (-1 if none). m_Previous is
+	// the offset of the previous record of the journal in the file,
+	// zero if the record holds the whole map (see setPrevious()).
+	//
+	unsigned int          m_Stored;
+	off_t                 m_Truncated;
+	off_t                 m_Previous;
+
+	// Blocks of the MappedIndex the map has been restored from. Blocks
+	// in the m_Blocks are newer and hide the Blocks of the base, part
+	// of the base behind m_BaseEnd has been truncated.
+	//
+	boost::shared_ptr<MappedIndex> m_Base;
+	off_t                          m_BaseEnd;
+
+	static size_t frameCount(const Entry& e)
+	{
+		return (e.olength + e.flength - 1) / e.flength;
+	}
+
+	Block block(const Entry& e) const;
+	void append(const Block& rBl);
 
-	void next(off_t offset, con_t::const_iterator &it) const;
-	unsigned int length(con_t::const_iterator &it, off_t offset) const;
-	void find(off_t offset, con_t::const_iterator &it) const;
+	void split(off_t offset);
+	void putExtents(unsigned int index);
+	void rebuildExtents();
+
+	void shortenBase(Block &rBl) const;
+
+	/**
+	 * Move Blocks of the m_Base to the m_Blocks.
+	 */
+	void materialize();
 
 	friend class boost::serialization::access;
 
 	template<class Archive>
-	void serialize(Archive& ar, const unsigned version)
+	void save(Archive& ar, const unsigned version) const
 	{
+		// A journal record holds only the Blocks added since
+		// the last store and the truncation done before them.
+
+		unsigned int first = (m_Previous == 0) ? 0 : m_Stored;
+		uint32_t count = m_Blocks.size() - first;
+
+		ar & m_Previous;
+		if (m_Previous != 0)
+			ar & m_Truncated;
+
 		ar & m_MaxLevel;
-		ar & m_MaxLength;
-		ar & m_Map;
+		ar & count;
+
+		for (std::vector<Entry>::const_iterator it = m_Blocks.begin() + first; it != m_Blocks.end(); ++it)
+		{
+			ar & it->offset & it->coffset;
+			ar & it->length & it->olength;
+			ar & it->clength;
+			ar & it->level;
+			ar & it->type;
+
+			if (it->type.isFramed())
+			{
+				ar & it->flength;
+				for (size_t i = 0; i < frameCount(*it); ++i)
+					ar & m_Frames[it->frames + i];
+			}
+		}
 	}
+
+	template<class Archive>
+	void load(Archive& ar, const unsigned version)
+	{
+		m_Blocks.clear();
+		m_Frames.clear();
+
+		m_Base.reset();
+		m_BaseEnd = 0;
+
+		m_Truncated = -1;
+		m_Previous = 0;
+
+		if (version == 0)
+		{
+			con_t map;
+
+			ar & m_MaxLevel;
+			ar & m_MaxLength;
+			ar & map;
+
+			for (con_t::iterator it = map.begin(); it != map.end(); ++it)
+			{
+				append(**it);
+				delete *it;
+			}
+		}
+		else
+		{
+			uint32_t count;
+			Entry    e;
+
+			if (version >= 2)
+			{
+				ar & m_Previous;
+				if (m_Previous != 0)
+					ar & m_Truncated;
+			}
+
+			ar & m_MaxLevel;
+			ar & count;
+
+			m_Blocks.reserve(count);
+			m_MaxLength = 0;
+
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				ar & e.offset & e.coffset;
+				ar & e.length & e.olength;
+				ar & e.clength;
+				ar & e.level;
+				ar & e.type;
+
+				e.flength = 0;
+				e.frames = m_Frames.size();
+
+				if (e.type.isFramed())
+				{
+					ar & e.flength;
+					if (e.flength == 0)
+						throw std::ios_base::failure("invalid frame length");
+
+					m_Frames.resize(e.frames + frameCount(e));
+					for (size_t j = 0; j < frameCount(e); ++j)
+						ar & m_Frames[e.frames + j];
+				}
+				m_Blocks.push_back(e);
+
+				if (m_MaxLength < e.length)
+					m_MaxLength = e.length;
+			}
+		}
+		rebuildExtents();
+
+		m_Stored = m_Blocks.size();
+		m_IsModified = false;
+	}
+
+	BOOST_SERIALIZATION_SPLIT_MEMBER()
 public:
 	LayerMap() :
 		m_MaxLevel(1),
 		m_MaxLength(0),
-		m_IsModified(false)
+		m_IsModified(false),
+		m_Stored(0),
+		m_Truncated(-1),
+		m_Previous(0),
+		m_BaseEnd(0)
 	{}
-	~LayerMap()
-	{
-		m_Map.clear();
-	}
-	LayerMap& operator=(const LayerMap& src)
-	{
-		m_MaxLevel = src.m_MaxLevel;
-		m_MaxLength = src.m_MaxLength;
-		m_IsModified = src.m_IsModified;
 
-		for (con_t::iterator it = m_Map.begin(); it != m_Map.end(); ++it)
-			delete(*it);
-		m_Map.clear();
-		m_Map = src.m_Map;
-
-		return *this;
-	}
-
-	void Put(Block *pBl, bool bKeepLevel = false);
+	/**
+	 * Add a copy of the Block to the map. The Block gets
+	 * the highest level unless bKeepLevel is set.
+	 */
+	void Put(const Block &rBl, bool bKeepLevel = false);
 
 	/**
 	 * Description:
-	 *  Return iterator that points to a Block that covers the specified offset.
+	 *  Return a Block that covers the specified offset.
 	 *  Caller may read up to rLength of bytes from the Block.
+	 *  If no Block covers the offset, the first Block visible
+	 *  behind the offset is returned with zero rLength.
+	 *
+	 *  Takes O(log n), the Block is found in the m_Extents
+	 *  or in the extents of the m_Base.
 	 *
 	 * Input:
 	 *  offset - caller wants to read from the specified offset
 	 * Output:
-	 *  it - return iterator that fits
-	 *  length - number of bytes to read from the Block pointed on to by returned iterator
+	 *  rBlock - the Block that fits
+	 *  rLength - number of bytes to read from the returned Block
 	 * Return:
-	 *  bool - true if something found, otherwise false.
+	 *  bool - true if something found, otherwise false. The errno
+	 *         is set to EIO if a record of the m_Base is corrupted.
 	 */
 	bool Get(off_t offset, Block &rBlock, off_t &rLength) const;
 
 	void Truncate(off_t length);
 
-	bool isCompressedOnlyWith(CompressionType& type)
-	{
-		for (con_t::iterator it = m_Map.begin(); it != m_Map.end(); ++it)
-		{
-			if ((*it)->type == type)
-			{
-				continue;
-			}
-			return false;
-		}
-		return true;
-	}
+	bool isCompressedOnlyWith(CompressionType& type);
 
 	bool isModified() const { return m_IsModified; }
 
+	/**
+	 * Number of Blocks in the map and number of them added
+	 * since the last store.
+	 */
+	size_t size() const { return (m_Base ? m_Base->blocks() : 0) + m_Blocks.size(); }
+	size_t changes() const { return m_Blocks.size() - m_Stored; }
+
+	/**
+	 * Select what the next save stores: the whole map if
+	 * previous is zero, otherwise only the changes since the
+	 * last store as a journal record that follows the record
+	 * stored at the offset previous.
+	 */
+	void setPrevious(off_t previous) { m_Previous = previous; }
+	off_t previous() const { return m_Previous; }
+
+	/**
+	 * Mark all Blocks as stored, the next journal record
+	 * starts from here.
+	 */
+	void setStored();
+
+	/**
+	 * Returns true if the changes should be stored as the whole map
+	 * rather than appended to the journal of `records` records that
+	 * hold `blocks` Blocks. The journal is compacted when it gets long
+	 * or when it holds more Blocks than a half of the map, so the cost
+	 * of stores stays proportional to the changes.
+	 */
+	bool isJournalFull(unsigned int records, size_t blocks) const;
+
+	static const unsigned int MaxJournalLength = 16;
+
+	/**
+	 * Replay the journal record rChanges loaded on top
+	 * of this map.
+	 */
+	void Apply(const LayerMap &rChanges);
+
+	/**
+	 * Replace content of the map by the Blocks of the index. The
+	 * index is used in place, Blocks put later are kept on top
+	 * of it.
+	 */
+	void setBase(const boost::shared_ptr<MappedIndex> &base);
+
+	/**
+	 * Append the whole map stored in the format of the MappedIndex
+	 * to the dest.
+	 */
+	void saveMapped(std::vector<char> &dest) const;
+
 	friend std::ostream &operator<<(std::ostream &os, const LayerMap &rLm);
 };
 
-BOOST_CLASS_VERSION(LayerMap, 0)
+// Version 1 stores the Blocks as a plain sequence of records
+// instead of a set of tracked pointers. Version 2 prefixes them
+// with the link to the previous record of the index journal.
+
+BOOST_CLASS_VERSION(LayerMap, 2)
 
 // Don't track instances of this class. Users create
 // them on the stack.
@@ -27,9 +27,8 @@
 
 #include "LinearMap.hpp"
 
-extern size_t g_BufferedMemorySize;
-
-LinearMap::LinearMap()
+LinearMap::LinearMap() :
+	m_size (0)
 {
 }
 
@@ -37,22 +36,9 @@ LinearMap::~LinearMap()
 {
 }
 
-LinearMap::Buffer *LinearMap::merge(Buffer *prev, Buffer *next) const
-{
-	Buffer *buffer = new (std::nothrow) Buffer(prev->buf, prev->size,
-	                                           next->buf, next->size);
-	assert(buffer);
-
-	delete prev;
-	delete next;
-
-	return buffer;
-}
-
 void LinearMap::insert(off_t offset, const char *buf, size_t size)
 {
-	Buffer *buffer = new Buffer(buf, size);
-	assert(buffer);
+	Buffer *buffer = NULL;
 
 	con_t::iterator it = m_map.lower_bound(offset);
 
@@ -62,28 +48,33 @@ void LinearMap::insert(off_t offset, const char *buf, size_t size)
 
 		if ((off_t) (prev->first + prev->second->size) == offset)
 		{
-			// Merge with previous Buffer
+			// Append to the previous Buffer
 			//
 			offset = prev->first;
-			size += prev->second->size;
-			Buffer *pb = prev->second;
-			m_map.erase(prev);
-			buffer = merge(pb, buffer);
+			buffer = prev->second;
+			buffer->append(buf, size);
 		}
 	}
+	if (buffer == NULL)
+	{
+		buffer = new Buffer(buf, size);
+		assert(buffer);
+	}
 	if (it != m_map.end())
 	{
-		if (it->first == (off_t) (offset + size))
+		if (it->first == (off_t) (offset + buffer->size))
 		{
 			// Merge with next Buffer
 			//
-			size += it->second->size;
 			Buffer *nb = it->second;
 			m_map.erase(it);
-			buffer = merge(buffer, nb);
+			buffer->append(nb->buf, nb->size);
+			delete nb;
 		}
 	}
 	m_map[offset] = buffer;
+
+	m_size += size;
 }
 
 int LinearMap::put(const char *buf, size_t size, off_t offset)
@@ -215,19 +206,11 @@ void LinearMap::truncate(off_t size)
 		assert(it->second->size >= 0);
 		if (it->first + (off_t) it->second->size > size)
 		{
-			// Truncate this Buffer.
-			//
-			off_t off = (it->first + it->second->size) - size;
-			
-			Buffer *buffer = new (std::nothrow)
-			                 Buffer(it->second->buf,
-			                        it->second->size - off);
-
-			delete it->second;
-
-			// Replace old Buffer with new truncated one.
+			// Truncate this Buffer, the space behind
+			// the new end is reused by appends.
 			//
-			it->second = buffer;
+			m_size -= it->first + it->second->size - size;
+			it->second->size = size - it->first;
 		}
 
 		++it;
@@ -237,6 +220,7 @@ void LinearMap::truncate(off_t size)
 	// 
 	while (it != m_map.end())
 	{
+		m_size -= it->second->size;
 		delete it->second;
 		m_map.erase(it++);
 	}
@@ -244,7 +228,7 @@ void LinearMap::truncate(off_t size)
 	Check();
 }
 
-bool LinearMap::erase(off_t *offset, char **buf, size_t *size, bool force)
+bool LinearMap::erase(off_t *offset, char **buf, size_t *size, bool force, size_t limit)
 {
 	size_t totalsize = 0;
 	con_t::iterator it = m_map.begin();
@@ -255,7 +239,7 @@ bool LinearMap::erase(off_t *offset, char **buf, size_t *size, bool force)
 
 		while (it != m_map.end())
 		{
-			if (it->second->size > g_BufferedMemorySize)
+			if (it->second->size > limit)
 				break;
 			totalsize += it->second->size;
 			++it;
@@ -263,7 +247,7 @@ bool LinearMap::erase(off_t *offset, char **buf, size_t *size, bool force)
 
 		if (it == m_map.end())
 		{
-			if (totalsize > 2 * g_BufferedMemorySize)
+			if (totalsize > 2 * limit)
 			{
 				it = m_map.begin();
 			}
@@ -273,6 +257,7 @@ bool LinearMap::erase(off_t *offset, char **buf, size_t *size, bool force)
 	if (it != m_map.end())
 	{
 		*offset = it->first;
+		m_size -= it->second->size;
 		it->second->release(buf, size);
 		delete it->second;
 		m_map.erase(it);
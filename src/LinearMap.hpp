@@ -24,6 +24,7 @@
 #include <utility>
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 
 class LinearMap
 {
@@ -31,41 +32,60 @@ class LinearMap
 	{
 		Buffer(const char *buf, size_t size) {
 			this->size = size;
-			this->buf = new char[this->size];
+			this->capacity = size;
+			this->buf = new char[this->capacity];
 			memcpy(this->buf, buf, this->size);
 		};
-		Buffer(const char *buf1, size_t size1,
-		       const char *buf2, size_t size2) {
-			this->size = size1 + size2;
-			this->buf = new char[this->size];
-			memcpy(this->buf, buf1, size1);
-			memcpy(this->buf + size1, buf2, size2);
-		};
 
 		~Buffer() {
 			delete[] this->buf;
 		};
 
+		/**
+		 * Add data to the end of the Buffer. Space is reserved
+		 * in advance so a sequence of appends copies every
+		 * byte only a few times.
+		 */
+		void append(const char *buf, size_t size) {
+			if (this->size + size > this->capacity)
+			{
+				size_t capacity = std::max(this->size + size, 2 * this->capacity);
+				char *tmp = new char[capacity];
+
+				memcpy(tmp, this->buf, this->size);
+				delete[] this->buf;
+				this->buf = tmp;
+				this->capacity = capacity;
+			}
+			memcpy(this->buf + this->size, buf, size);
+			this->size += size;
+		};
+
 		void release(char **buf, size_t *size) {
 			*buf = this->buf;
 			*size = this->size;
 			this->buf = NULL;
 			this->size = 0;
+			this->capacity = 0;
 		}
 
 		char	*buf;
 		size_t	 size;
+		size_t	 capacity;
 	};
 
 	typedef std::map<off_t, Buffer *>	con_t;
 	
 	con_t	m_map;
 
+	// Number of bytes stored in all Buffers.
+	//
+	size_t	m_size;
+
 	con_t::const_iterator get(off_t offset) const;
 
 	void inline Check() const;
 
-	Buffer *merge(Buffer *prev, Buffer *next) const;
 	void insert(off_t offset, const char *buf, size_t size);
 
 public:
@@ -94,12 +114,15 @@ public:
 	 *
 	 * @param force - if true it returns block even if it doesn't fit
 	 *                any criterias.
+	 * @param limit - minimal length of the continuous block.
 	 * 
 	 * @return true if some block is returned
 	 */
-	bool erase(off_t *offset, char **buf, size_t *size, bool force);
+	bool erase(off_t *offset, char **buf, size_t *size, bool force, size_t limit);
 
 	bool empty() { return m_map.empty(); };
+
+	size_t size() const { return m_size; };
 	
 	void truncate(off_t size);
 
@@ -0,0 +1,181 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <ios>
+
+#include "rlog/rlog.h"
+
+#include "MappedIndex.hpp"
+#include "assert.h"
+
+// Starts with the identification of the FileHeader. Indexes stored
+// in the portable archive start with the data of the archive or with
+// a header of the compression method, none of them looks like this.
+
+const char MappedIndex::Magic[8] = { '\037', '\135', '\211', 'F', 'C', 'I', 'X', '\001' };
+
+MappedIndex::MappedIndex(int fd, off_t offset) :
+	m_Map(NULL),
+	m_MapSize(0),
+	m_IsMapped(false)
+{
+	Header header;
+
+	if ((::pread(fd, &header, sizeof(header), offset) != sizeof(header)) ||
+	    !isMapped(header.magic, sizeof(header.magic)))
+	{
+		throw std::ios_base::failure("invalid index");
+	}
+
+	size_t length = size(header.blocks, header.extents, header.frames);
+
+	struct stat st;
+
+	if ((::fstat(fd, &st) == -1) || (offset + (off_t) length > st.st_size))
+		throw std::ios_base::failure("truncated index");
+
+	// Map the index from the start of the page it begins in.
+
+	off_t start = offset & ~((off_t) ::sysconf(_SC_PAGESIZE) - 1);
+
+	m_MapSize = offset - start + length;
+
+	void *map = ::mmap(NULL, m_MapSize, PROT_READ, MAP_SHARED, fd, start);
+	if (map != MAP_FAILED)
+	{
+		m_Map = (char *) map;
+		m_IsMapped = true;
+	}
+	else
+	{
+		// File system of the lower file doesn't support mmap,
+		// read the whole index to the memory.
+
+		rDebug("%s: mmap failed with errno: %d", __PRETTY_FUNCTION__, errno);
+
+		m_Map = new char[m_MapSize];
+
+		if (::pread(fd, m_Map + (offset - start), length, offset) != (ssize_t) length)
+		{
+			delete[] m_Map;
+			throw std::ios_base::failure("truncated index");
+		}
+	}
+
+	const char *base = m_Map + (offset - start);
+
+	m_Header = (const Header *) base;
+	m_Records = (const Record *) (base + sizeof(Header));
+	m_Extents = (const Extent *) (m_Records + header.blocks);
+	m_Frames = (const le32_t *) (m_Extents + header.extents);
+}
+
+MappedIndex::~MappedIndex()
+{
+	if (m_IsMapped)
+		::munmap(m_Map, m_MapSize);
+	else
+		delete[] m_Map;
+}
+
+bool MappedIndex::isMapped(const char *buf, size_t size)
+{
+	return (size >= sizeof(Magic)) && (memcmp(buf, Magic, sizeof(Magic)) == 0);
+}
+
+size_t MappedIndex::size(size_t blocks, size_t extents, size_t frames)
+{
+	return sizeof(Header) + blocks * sizeof(Record) +
+	       extents * sizeof(Extent) + frames * sizeof(le32_t);
+}
+
+bool MappedIndex::block(unsigned int index, Block &rBlock) const
+{
+	if (index >= blocks())
+		return false;
+
+	const Record &r = m_Records[index];
+
+	rBlock.offset = r.offset;
+	rBlock.coffset = r.coffset;
+	rBlock.length = r.length;
+	rBlock.olength = r.olength;
+	rBlock.clength = r.clength;
+	rBlock.level = r.level;
+	rBlock.type.setType(r.type);
+	rBlock.flength = 0;
+	rBlock.frames.clear();
+
+	if (rBlock.type.isFramed())
+	{
+		// Frames must be inside of the array of frames.
+
+		if (r.flength == 0)
+			return false;
+
+		rBlock.flength = r.flength;
+
+		size_t first = r.frames;
+		size_t count = (rBlock.olength + rBlock.flength - 1) / rBlock.flength;
+
+		if (first + count > m_Header->frames)
+			return false;
+
+		rBlock.frames.assign(m_Frames + first, m_Frames + first + count);
+	}
+	return true;
+}
+
+bool MappedIndex::extentBlock(unsigned int index, Block &rBlock) const
+{
+	assert(index < extents());
+
+	const Extent &e = m_Extents[index];
+
+	if (!block(e.block, rBlock))
+		return false;
+
+	return (e.start < e.end) && (e.start >= rBlock.offset) &&
+	       (e.end <= rBlock.offset + (off_t) rBlock.length);
+}
+
+unsigned int MappedIndex::upperBound(off_t offset) const
+{
+	unsigned int first = 0;
+	unsigned int count = extents();
+
+	while (count > 0)
+	{
+		unsigned int half = count / 2;
+
+		if (start(first + half) <= offset)
+		{
+			first += half + 1;
+			count -= half + 1;
+		}
+		else
+			count = half;
+	}
+	return first;
+}
@@ -0,0 +1,177 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAPPEDINDEX_HPP
+#define MAPPEDINDEX_HPP
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#include "Block.hpp"
+
+/**
+ * Index of a file stored in a flat binary format that is used in place,
+ * mapped to the memory, there is nothing to deserialize. Only the header
+ * is checked when the index is mapped, the records are checked when they
+ * are read, so the pages of the index are loaded on demand.
+ *
+ * The index is not compressed. It starts with a Header followed by
+ * arrays of fixed size records, all numbers are little endian:
+ *
+ *   Header
+ *   Record  [header.blocks]  - the Blocks
+ *   Extent  [header.extents] - non-overlapping extents sorted by start
+ *   uint32  [header.frames]  - offsets of frames of framed Blocks
+ *
+ * Extents are the resolved view of the Blocks, see LayerMap.
+ */
+class MappedIndex
+{
+public:
+	// Number stored in N bytes in little endian, without
+	// any alignment requirements.
+	//
+	template<typename T, int N>
+	class Little
+	{
+		unsigned char m_Bytes[N];
+	public:
+		operator T() const
+		{
+			uint64_t v = 0;
+
+			for (int i = N - 1; i >= 0; --i)
+				v = (v << 8) | m_Bytes[i];
+			return (T) v;
+		}
+
+		Little& operator=(T t)
+		{
+			uint64_t v = t;
+
+			for (int i = 0; i < N; ++i, v >>= 8)
+				m_Bytes[i] = v & 0xff;
+			return *this;
+		}
+	};
+
+	typedef Little<uint32_t, 4> le32_t;
+	typedef Little<int64_t, 8>  le64_t;
+
+	// Identification of the index, the first bytes of the index
+	// compressed by any of the supported methods differ.
+	//
+	static const char Magic[8];
+
+	struct Header
+	{
+		char   magic[8];
+		le32_t maxLevel;
+		le32_t maxLength;
+		le32_t blocks;
+		le32_t extents;
+		le32_t frames;
+		le32_t reserved;
+	};
+
+	struct Record
+	{
+		le64_t offset;
+		le64_t coffset;
+		le32_t length;
+		le32_t olength;
+		le32_t clength;
+		le32_t level;
+		le32_t flength;
+		le32_t frames;		// Index to the frames.
+		unsigned char type;
+		char   reserved[7];
+	};
+
+	struct Extent
+	{
+		le64_t start;
+		le64_t end;
+		le32_t block;		// Index to the Records.
+		le32_t reserved;
+	};
+
+	/**
+	 * Map the index stored at the `offset` of the file `fd`.
+	 *
+	 * @throws std::ios_base::failure if the header is not valid
+	 *         or the index doesn't fit to the file.
+	 */
+	MappedIndex(int fd, off_t offset);
+	~MappedIndex();
+
+	/**
+	 * Check the first bytes of an index. Returns true if it is
+	 * stored in this format.
+	 */
+	static bool isMapped(const char *buf, size_t size);
+
+	/**
+	 * Length of the index with the given number of items.
+	 */
+	static size_t size(size_t blocks, size_t extents, size_t frames);
+
+	unsigned int maxLevel() const { return m_Header->maxLevel; }
+	unsigned int maxLength() const { return m_Header->maxLength; }
+	unsigned int blocks() const { return m_Header->blocks; }
+	unsigned int extents() const { return m_Header->extents; }
+
+	/**
+	 * Read the Block of the record `index`. Returns false
+	 * if the record is corrupted.
+	 */
+	bool block(unsigned int index, Block &rBlock) const;
+
+	/**
+	 * Read the Block of the extent `index`. Returns false if the
+	 * extent or its record is corrupted, the extent must lie inside
+	 * of its Block.
+	 */
+	bool extentBlock(unsigned int index, Block &rBlock) const;
+
+	off_t start(unsigned int index) const { return m_Extents[index].start; }
+	off_t end(unsigned int index) const { return m_Extents[index].end; }
+
+	/**
+	 * Returns index of the first extent that starts after
+	 * the offset (extents() if there is no such extent).
+	 * Takes O(log n).
+	 */
+	unsigned int upperBound(off_t offset) const;
+
+private:
+	char            *m_Map;
+	size_t           m_MapSize;
+	bool             m_IsMapped;
+
+	const Header    *m_Header;
+	const Record    *m_Records;
+	const Extent    *m_Extents;
+	const le32_t    *m_Frames;
+
+	MappedIndex(const MappedIndex &);		// No copy constructor
+	MappedIndex& operator=(const MappedIndex &);	// No assign operator
+};
+
+#endif
+
@@ -22,18 +22,32 @@
 #include <sstream>
 #include <errno.h>
 #include <cstring>
+#include <ctime>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <boost/scoped_array.hpp>
+
 #include "rlog/rlog.h"
 #include "assert.h"
 
 #include "FileUtils.hpp"
 #include "Memory.hpp"
 #include "LinearMap.hpp"
+#include "ThreadPool.hpp"
+#include "WriteBack.hpp"
+
+extern unsigned int g_BufferedMemorySize;
+extern ThreadPool   g_ThreadPool;
+extern WriteBack    g_WriteBack;
+
+// Store only whole blocks of g_BufferedMemorySize that start
+// at multiples of it.
+//
+bool g_AlignBlocks = false;
 
 Memory::Memory(const struct stat *st, const char *name) :
 	Parent (st, name),
@@ -79,6 +93,7 @@ int Memory::merge(const char *name)
 			// don't forget to release allocated memory...
 
 			m_LinearMap.truncate(0);
+			g_WriteBack.update(this, 0);
 
 			m_FileSize = 0;
 			m_FileSizeSet = false;
@@ -158,6 +173,7 @@ int Memory::unlink(const char *name)
 		// buffers allocated so far...
 		// 
 		m_LinearMap.truncate(0);
+		g_WriteBack.update(this, 0);
 
 		m_FileSize = 0;
 		m_FileSizeSet = false;
@@ -180,6 +196,7 @@ int Memory::truncate(const char *name, off_t size)
 	if (r == 0)
 	{
 		m_LinearMap.truncate(size);
+		g_WriteBack.update(this, m_LinearMap.size());
 
 		m_FileSize = size;
 		m_FileSizeSet = true;
@@ -192,9 +209,36 @@ int Memory::truncate(const char *name, off_t size)
 	return r;
 }
 
-int Memory::getattr(const char *name, struct stat *st)
+int Memory::fallocate(const char *name, int mode, off_t offset, off_t length)
+{
+	assert(m_name == name);
+
+	m_TimeSet = false;
+
+	// Only the modes that don't move the data are supported (see
+	// Compress::fallocate()), a hole must hide the data cached in
+	// the memory as well.
+
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && (write(true) == -1))
+		return -1;
+
+	int r = Parent::fallocate(mode, offset, length);
+	if (r == 0)
+	{
+		if (!(mode & FALLOC_FL_KEEP_SIZE))
+			m_FileSize = max(m_FileSize, offset + length);
+	}
+	else
+	{
+		rDebug("Memory::fallocate('%s', 0x%x) failed with errno: %d",
+		        m_name.c_str(), mode, errno);
+	}
+	return r;
+}
+
+int Memory::getattr(const char *name, struct stat *st, bool known)
 {
-	int r = Parent::getattr(name, st);
+	int r = Parent::getattr(name, st, known);
 
 	rDebug("Memory::getattr(%p) m_FileSize: 0x%lx, m_FileSizeSet: %d",
 		(void *) this, (long int) m_FileSize, m_FileSizeSet);
@@ -214,17 +258,95 @@ int Memory::write(bool force)
 	ssize_t	 len;
 	off_t	 offset;
 
-	while (m_LinearMap.erase(&offset, &buf, &size, force) == true)
+	// Collect enough data to keep all worker threads busy, the
+	// Compress layer splits it into blocks of g_BufferedMemorySize
+	// and compresses them in parallel.
+
+	size_t limit = (size_t) g_BufferedMemorySize * max(1U, g_ThreadPool.size());
+
+	int r = 0;
+
+	while (m_LinearMap.erase(&offset, &buf, &size, force, limit) == true)
 	{
 		rDebug("Memory::write(bool %d) | offset: 0x%lx, size: 0x%lx",
 			force, (unsigned long) offset, (unsigned long) size);
 
-		len = Parent::write(buf, size, offset);
+		if (g_AlignBlocks && isCompressed())
+			len = writeAligned(buf, size, offset);
+		else
+			len = Parent::write(buf, size, offset);
 		delete[] buf;
 		if (len == -1)
+		{
+			r = -1;
+			break;
+		}
+	}
+
+	g_WriteBack.update(this, m_LinearMap.size());
+
+	return r;
+}
+
+int Memory::flushCache()
+{
+	rDebug("Memory::flushCache(%s) | cached: 0x%lx",
+		m_name.c_str(), (long int) m_LinearMap.size());
+
+	return write(true);
+}
+
+ssize_t Memory::writeAligned(const char *buf, size_t size, off_t offset)
+{
+	off_t start = offset - offset % g_BufferedMemorySize;
+	off_t end = offset + size;
+
+	if (end % g_BufferedMemorySize)
+		end += g_BufferedMemorySize - end % g_BufferedMemorySize;
+
+	// The last block ends with the file.
+
+	assert(m_FileSize >= (off_t) (offset + size));
+	end = min(end, m_FileSize);
+
+	rDebug("Memory::writeAligned(%s) | offset: 0x%lx, size: 0x%lx, start: 0x%lx, end: 0x%lx",
+		m_name.c_str(), (long int) offset, (long int) size, (long int) start, (long int) end);
+
+	boost::scoped_array<char> chunk;
+
+	if ((start < offset) || (end > (off_t) (offset + size)))
+	{
+		// Read the rest of the blocks, from the memory
+		// or from the disk, and put the buffer in between.
+
+		chunk.reset(new char[end - start]);
+
+		if (read(chunk.get(), offset - start, start) == -1)
 			return -1;
+
+		memcpy(chunk.get() + (offset - start), buf, size);
+
+		off_t tail = offset + size;
+
+		if (read(chunk.get() + (tail - start), end - tail, tail) == -1)
+			return -1;
+
+		buf = chunk.get();
 	}
-	return 0;
+
+	// Parent splits big buffers into blocks only when
+	// it compresses them in parallel.
+
+	off_t step = (g_ThreadPool.size() > 1) ? end - start : (off_t) g_BufferedMemorySize;
+
+	for (off_t off = start; off < end; off += step)
+	{
+		ssize_t r = Parent::write(buf + (off - start), min(step, end - off), off);
+		if (r == -1)
+			return -1;
+	}
+
+	return size;
 }
 
 ssize_t Memory::write(const char *buf, size_t size, off_t offset)
@@ -234,13 +356,41 @@ ssize_t Memory::write(const char *buf, size_t size, off_t offset)
 
 	m_TimeSet = false;
 
-	if ((m_FileSize == offset) && FileUtils::isZeroOnly(buf, size))
+	// Writes to the m_LinearMap reach the Compress layer much later,
+	// the file is not idle while they come.
+
+	setLastWrite(time(NULL));
+
+	assert(m_FileSizeSet == true);
+	assert(size > 0);
+
+	// Zeros written behind the end of the file don't need to be
+	// stored, the file is just extended. Parts of the file without
+	// any data are read as zeros.
+
+	off_t	 end = offset + size;
+	size_t	 osize = size;
+
+	if (offset >= m_FileSize)
+	{
+		size_t zeros = FileUtils::zeroPrefix(buf, size);
+
+		buf    += zeros;
+		offset += zeros;
+		size   -= zeros;
+	}
+	if ((size > 0) && (end > m_FileSize))
+	{
+		size_t zeros = FileUtils::zeroSuffix(buf, size);
+
+		size -= min(zeros, (size_t) (end - max(offset, m_FileSize)));
+	}
+
+	if (size == 0)
 	{
 		rDebug("Memory::write(%s) | Full of zeroes only", m_name.c_str());
 
-		assert(m_FileSizeSet == true);
-		assert(size > 0);
-		m_FileSize = offset + size;
+		m_FileSize = max(m_FileSize, end);
 	}
 	else
 	{
@@ -249,18 +399,17 @@ ssize_t Memory::write(const char *buf, size_t size, off_t offset)
 		if (m_LinearMap.put(buf, size, offset) == -1)
 			return -1;
 
-		assert(m_FileSizeSet == true);
-		assert(size > 0);
-		m_FileSize = max(m_FileSize, (off_t) (offset + size));
+		m_FileSize = max(m_FileSize, end);
 
-		// Try to write a block to disk if appropriate.
+		// Try to write a block to disk if appropriate. Write
+		// everything if all files cache too much data.
 		// 
-		int r = write(false);
+		int r = write(g_WriteBack.update(this, m_LinearMap.size()));
 		if (r == -1)
 			return r;
 	}
 
-	return size;
+	return osize;
 }
 
 ssize_t Memory::readFullParent(char * &buf, size_t &len, off_t &offset) const
@@ -39,6 +39,13 @@ private:
 	typedef PARENT_MEMORY Parent;
 
 	int write(bool force);
+
+	/**
+	 * Write the buffer as whole blocks aligned to g_BufferedMemorySize
+	 * (see g_AlignBlocks). Parts of the blocks the buffer doesn't cover
+	 * are read first so a partial overwrite rewrites the whole block.
+	 */
+	ssize_t writeAligned(const char *buf, size_t size, off_t offset);
 	int merge(const char *name);
 	ssize_t readFullParent(char * &buf, size_t &len, off_t &offset) const;
 	ssize_t readParent(char * &buf, size_t &len, off_t &offset, off_t block_offset) const;
@@ -65,7 +72,9 @@ public:
 
 	int truncate(const char *name, off_t size);
 
-	int getattr(const char *name, struct stat *st);
+	int fallocate(const char *name, int mode, off_t offset, off_t length);
+
+	int getattr(const char *name, struct stat *st, bool known = false);
 
 	ssize_t read(char *buf, size_t size, off_t offset) const;
 
@@ -73,6 +82,11 @@ public:
 
 	int utimens(const char *name, const struct timespec tv[2]);
 
+	/**
+	 * Write all data cached in the memory to the disk.
+	 */
+	int flushCache();
+
 	friend ostream &operator<<(ostream &os, const Memory &rMemory);
 };
 
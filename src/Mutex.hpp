@@ -28,6 +28,8 @@
 
 class Mutex
 {
+	friend class Condition;
+
 	pthread_mutex_t	m_Mutex;
 
 public:
@@ -0,0 +1,97 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RWLOCK_H
+#define RWLOCK_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include "rlog/rlog.h"
+
+/**
+ * Lock that may be held by many readers or by one writer.
+ */
+class RWLock
+{
+	pthread_rwlock_t m_RWLock;
+
+	RWLock(const RWLock &);			// No copy constructor
+	RWLock& operator=(const RWLock &);	// No assign operator
+public:
+	RWLock()
+	{
+		pthread_rwlockattr_t attr;
+
+		pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+		// Don't let a stream of readers starve writers.
+
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+		int r = pthread_rwlock_init(&m_RWLock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+		if (r != 0)
+		{
+			rError("%s failed (%s)", __PRETTY_FUNCTION__, strerror(r));
+			kill(0, SIGABRT);
+		}
+	}
+
+	~RWLock()
+	{
+		int r = pthread_rwlock_destroy(&m_RWLock);
+		if (r != 0)
+		{
+			rError("%s failed (%s)", __PRETTY_FUNCTION__, strerror(r));
+			kill(0, SIGABRT);
+		}
+	}
+
+	void ReadLock(void)
+	{
+		int r = pthread_rwlock_rdlock(&m_RWLock);
+		if (r != 0)
+		{
+			rError("%s failed (%s)", __PRETTY_FUNCTION__, strerror(r));
+			kill(0, SIGABRT);
+		}
+	}
+
+	void WriteLock(void)
+	{
+		int r = pthread_rwlock_wrlock(&m_RWLock);
+		if (r != 0)
+		{
+			rError("%s failed (%s)", __PRETTY_FUNCTION__, strerror(r));
+			kill(0, SIGABRT);
+		}
+	}
+
+	void Unlock(void)
+	{
+		int r = pthread_rwlock_unlock(&m_RWLock);
+		if (r != 0)
+		{
+			rError("%s failed (%s)", __PRETTY_FUNCTION__, strerror(r));
+			kill(0, SIGABRT);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,90 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+
+#include "Statistics.hpp"
+
+Statistics g_Statistics;
+
+Statistics::Statistics()
+{
+	memset(m_histogram, 0, sizeof(m_histogram));
+	memset(m_total, 0, sizeof(m_total));
+}
+
+const char *Statistics::getName(Operation op)
+{
+	switch (op)
+	{
+	case READ:
+		return "read";
+	case WRITE:
+		return "write";
+	case OPEN:
+		return "open";
+	case RELEASE:
+		return "release";
+	case GETATTR:
+		return "getattr";
+	case TRUNCATE:
+		return "truncate";
+	default:
+		return "unknown";
+	}
+}
+
+void Statistics::add(Operation op, unsigned long long usec)
+{
+	unsigned int bucket = 0;
+
+	for (unsigned long long t = usec; (t > 0) && (bucket < Buckets - 1); t >>= 1)
+		bucket++;
+
+	__sync_fetch_and_add(&m_histogram[op][bucket], 1);
+	__sync_fetch_and_add(&m_total[op], usec);
+}
+
+std::ostream &operator<<(std::ostream &os, const Statistics &rStatistics)
+{
+	for (unsigned int op = 0; op < Statistics::OPERATIONS; ++op)
+	{
+		unsigned long long count = 0;
+
+		for (unsigned int i = 0; i < Statistics::Buckets; ++i)
+			count += __atomic_load_n(&rStatistics.m_histogram[op][i], __ATOMIC_RELAXED);
+
+		os << Statistics::getName((Statistics::Operation) op) << ": count: " << count
+		   << ", total: " << __atomic_load_n(&rStatistics.m_total[op], __ATOMIC_RELAXED) << " us";
+
+		// Print only non-empty buckets as "<upper bound in us>: count".
+
+		for (unsigned int i = 0; i < Statistics::Buckets; ++i)
+		{
+			unsigned long long n = __atomic_load_n(&rStatistics.m_histogram[op][i], __ATOMIC_RELAXED);
+
+			if (n == 0)
+				continue;
+			if (i == Statistics::Buckets - 1)
+				os << ", inf: " << n;
+			else
+				os << ", <" << (1ULL << i) << ": " << n;
+		}
+		os << std::endl;
+	}
+	return os;
+}
@@ -0,0 +1,96 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATISTICS_HPP
+#define STATISTICS_HPP
+
+#include <time.h>
+
+#include <iostream>
+
+/**
+ * Histograms of latencies of the file system operations. Counters
+ * are updated atomically, no lock is needed.
+ */
+class Statistics
+{
+public:
+	enum Operation
+	{
+		READ,
+		WRITE,
+		OPEN,
+		RELEASE,
+		GETATTR,
+		TRUNCATE,
+		OPERATIONS
+	};
+
+private:
+	// Bucket 0 counts operations that took less than 1 microsecond,
+	// bucket i (i > 0) operations that took 2^(i-1) to 2^i - 1
+	// microseconds. The last bucket counts also all longer ones.
+	//
+	static const unsigned int Buckets = 32;
+
+	unsigned long long m_histogram[OPERATIONS][Buckets];
+
+	// Sum of latencies in microseconds.
+	//
+	unsigned long long m_total[OPERATIONS];
+
+	static const char *getName(Operation op);
+
+	Statistics(const Statistics &);			// No copy constructor
+	Statistics& operator=(const Statistics &);	// No assign operator
+public:
+	Statistics();
+
+	void add(Operation op, unsigned long long usec);
+
+	friend std::ostream &operator<<(std::ostream &os, const Statistics &rStatistics);
+};
+
+/**
+ * Measures time from its construction to its destruction and adds
+ * it to the statistics.
+ */
+class StatisticsTimer
+{
+	Statistics		&m_rStatistics;
+	Statistics::Operation	 m_op;
+	struct timespec		 m_start;
+public:
+	StatisticsTimer(Statistics &rStatistics, Statistics::Operation op) :
+		m_rStatistics (rStatistics),
+		m_op (op)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &m_start);
+	}
+
+	~StatisticsTimer()
+	{
+		struct timespec end;
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		m_rStatistics.add(m_op, (end.tv_sec - m_start.tv_sec) * 1000000ULL +
+		                        end.tv_nsec / 1000 - m_start.tv_nsec / 1000);
+	}
+};
+
+#endif
@@ -0,0 +1,121 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+
+#include "rlog/rlog.h"
+#include "assert.h"
+
+#include "ThreadPool.hpp"
+#include "Lock.hpp"
+
+// Programs start worker threads if they want to
+// do some work in the background.
+
+ThreadPool g_ThreadPool;
+
+ThreadPool::ThreadPool() :
+	m_stop (false)
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+	stop();
+}
+
+void *ThreadPool::worker(void *arg)
+{
+	ThreadPool *pool = reinterpret_cast<ThreadPool *> (arg);
+
+	while (true)
+	{
+		Job *job;
+		{
+			Lock lock(pool->m_mutex);
+
+			while (pool->m_queue.empty() && !pool->m_stop)
+				pool->m_cond.Wait(pool->m_mutex);
+
+			if (pool->m_stop)
+				break;
+
+			job = pool->m_queue.front();
+			pool->m_queue.pop_front();
+		}
+
+		job->run();
+		delete job;
+	}
+	return NULL;
+}
+
+void ThreadPool::start(unsigned int threads)
+{
+	assert(m_threads.empty());
+
+	m_stop = false;
+
+	for (unsigned int i = 0; i < threads; ++i)
+	{
+		pthread_t thread;
+
+		int r = pthread_create(&thread, NULL, ThreadPool::worker, this);
+		if (r != 0)
+		{
+			rError("%s: Failed to create a worker thread (%s)",
+				__PRETTY_FUNCTION__, strerror(r));
+			break;
+		}
+		m_threads.push_back(thread);
+	}
+}
+
+void ThreadPool::stop()
+{
+	{
+		Lock lock(m_mutex);
+
+		m_stop = true;
+		m_cond.Broadcast();
+	}
+
+	for (unsigned int i = 0; i < m_threads.size(); ++i)
+		pthread_join(m_threads[i], NULL);
+	m_threads.clear();
+
+	while (!m_queue.empty())
+	{
+		delete m_queue.front();
+		m_queue.pop_front();
+	}
+}
+
+void ThreadPool::push(Job *job)
+{
+	if (!isRunning())
+	{
+		job->run();
+		delete job;
+		return;
+	}
+
+	Lock lock(m_mutex);
+
+	m_queue.push_back(job);
+	m_cond.Signal();
+}
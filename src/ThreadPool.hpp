@@ -0,0 +1,89 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+
+#include "Mutex.hpp"
+#include "Condition.hpp"
+
+/**
+ * Set of worker threads that run Jobs in the background.
+ */
+class ThreadPool
+{
+public:
+	/**
+	 * Unit of work. The ThreadPool deletes the Job when
+	 * the Job has been run.
+	 */
+	class Job
+	{
+	public:
+		virtual ~Job() { }
+		virtual void run() = 0;
+	};
+
+private:
+	std::deque<Job *>	m_queue;
+	std::vector<pthread_t>	m_threads;
+
+	bool		m_stop;
+
+	// Protects m_queue and m_stop.
+	//
+	Mutex		m_mutex;
+	Condition	m_cond;
+
+	static void *worker(void *arg);
+
+	ThreadPool(const ThreadPool &);			// No copy constructor
+	ThreadPool& operator=(const ThreadPool &);	// No assign operator
+public:
+	ThreadPool();
+	~ThreadPool();
+
+	/**
+	 * Start `threads` worker threads. Must be called after
+	 * the process forked to the background.
+	 */
+	void start(unsigned int threads);
+
+	/**
+	 * Wait until the running jobs finish, delete
+	 * the waiting ones and stop all worker threads.
+	 */
+	void stop();
+
+	bool isRunning() const { return !m_threads.empty(); }
+
+	unsigned int size() const { return m_threads.size(); }
+
+	/**
+	 * Queue the `job` to be run by a worker thread. The job
+	 * is run immediately in the caller's thread if there
+	 * are no worker threads.
+	 */
+	void push(Job *job);
+};
+
+#endif
@@ -0,0 +1,171 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cerrno>
+#include <cstring>
+
+#include "rlog/rlog.h"
+#include "assert.h"
+
+#include "WriteBack.hpp"
+#include "FileManager.hpp"
+#include "Lock.hpp"
+
+extern FileManager	*g_FileManager;
+
+// Programs start the thread if they want the data to be
+// written in the background. Without it the writers write
+// their own data once the limit is reached.
+
+WriteBack g_WriteBack;
+
+WriteBack::WriteBack() :
+	m_total (0),
+	m_limit (0),
+	m_running (false),
+	m_stop (false)
+{
+}
+
+WriteBack::~WriteBack()
+{
+	stop();
+}
+
+void *WriteBack::worker(void *arg)
+{
+	WriteBack *writeBack = reinterpret_cast<WriteBack *> (arg);
+
+	Lock lock(writeBack->m_mutex);
+
+	while (!writeBack->m_stop)
+	{
+		if (writeBack->m_total <= writeBack->m_limit)
+		{
+			writeBack->m_cond.Wait(writeBack->m_mutex);
+			continue;
+		}
+
+		// Write the data of the files that cache the most
+		// until they cache less than half of the limit.
+
+		while (!writeBack->m_stop && (writeBack->m_total > writeBack->m_limit / 2))
+		{
+			con_t::iterator biggest = writeBack->m_dirty.begin();
+
+			for (con_t::iterator it = biggest; it != writeBack->m_dirty.end(); ++it)
+			{
+				if (it->second > biggest->second)
+					biggest = it;
+			}
+
+			// The file can't be released until it leaves m_dirty,
+			// take a reference so it stays valid once we unlock.
+
+			CFile *file = static_cast<CFile *> (biggest->first);
+
+			g_FileManager->Hold(file);
+
+			writeBack->m_mutex.Unlock();
+
+			file->Lock();
+			int r = file->flushCache();
+			file->Unlock();
+
+			g_FileManager->Put(file);
+
+			writeBack->m_mutex.Lock();
+
+			if (r == -1)
+			{
+				// Try again with the next write.
+
+				rError("%s: Failed to write cached data, errno: %d",
+					__PRETTY_FUNCTION__, errno);
+
+				writeBack->m_cond.Wait(writeBack->m_mutex);
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+void WriteBack::start()
+{
+	assert(!m_running);
+
+	if (m_limit == 0)
+		return;
+
+	m_stop = false;
+
+	int r = pthread_create(&m_thread, NULL, WriteBack::worker, this);
+	if (r != 0)
+	{
+		rError("%s: Failed to create the write-back thread (%s)",
+			__PRETTY_FUNCTION__, strerror(r));
+		return;
+	}
+	m_running = true;
+}
+
+void WriteBack::stop()
+{
+	if (!m_running)
+		return;
+	{
+		Lock lock(m_mutex);
+
+		m_stop = true;
+		m_cond.Signal();
+	}
+
+	pthread_join(m_thread, NULL);
+	m_running = false;
+}
+
+bool WriteBack::update(Memory *file, size_t dirty)
+{
+	Lock lock(m_mutex);
+
+	con_t::iterator it = m_dirty.find(file);
+
+	if (it != m_dirty.end())
+	{
+		m_total -= it->second;
+
+		if (dirty == 0)
+			m_dirty.erase(it);
+		else
+			it->second = dirty;
+	}
+	else if (dirty > 0)
+		m_dirty[file] = dirty;
+
+	m_total += dirty;
+
+	if ((m_limit == 0) || (m_total <= m_limit))
+		return false;
+
+	if (!m_running)
+		return true;
+
+	m_cond.Signal();
+
+	return m_total > 2 * m_limit;
+}
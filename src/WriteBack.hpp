@@ -0,0 +1,88 @@
+/*
+    This file is part of FuseCompress.
+
+    FuseCompress is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    FuseCompress is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with FuseCompress.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WRITEBACK_HPP
+#define WRITEBACK_HPP
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <map>
+
+#include "Mutex.hpp"
+#include "Condition.hpp"
+
+class Memory;
+
+/**
+ * Accountant of the data written to the files that is cached in the
+ * memory (see Memory) and not yet compressed. When the files together
+ * cache more than a limit, a thread writes the data of the files that
+ * cache the most until they cache less than half of the limit.
+ */
+class WriteBack
+{
+	typedef std::map<Memory *, size_t> con_t;
+
+	// Cached bytes of the files that cache any.
+	//
+	con_t		m_dirty;
+	size_t		m_total;
+
+	// Zero means no limit.
+	//
+	size_t		m_limit;
+
+	pthread_t	m_thread;
+	bool		m_running;
+	bool		m_stop;
+
+	// Protects all above but m_limit, m_thread and m_running.
+	//
+	Mutex		m_mutex;
+	Condition	m_cond;
+
+	static void *worker(void *arg);
+
+	WriteBack(const WriteBack &);			// No copy constructor
+	WriteBack& operator=(const WriteBack &);	// No assign operator
+public:
+	WriteBack();
+	~WriteBack();
+
+	void setLimit(size_t limit) { m_limit = limit; }
+
+	/**
+	 * Start the thread. Must be called after the process
+	 * forked to the background.
+	 */
+	void start();
+
+	void stop();
+
+	/**
+	 * Set the number of bytes the `file` caches. Must be called with
+	 * the file locked, the file must stay open while it caches any.
+	 *
+	 * Returns true if the files cache so much that the thread can't
+	 * keep up and the caller should write its data itself.
+	 */
+	bool update(Memory *file, size_t dirty);
+};
+
+#endif
+
@@ -0,0 +1,166 @@
+// (C) Copyright Milan Svoboda 2009.
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt.)
+
+// See http://www.boost.org/libs/iostreams for documentation.
+
+#ifndef LZ4_FILTER_HPP
+#define LZ4_FILTER_HPP
+
+#include <lz4.h>
+#include <lz4hc.h>
+
+#include <boost/iostreams/filter/aggregate.hpp>
+#include <boost/iostreams/detail/ios.hpp> // failure.
+
+// The LZ4 block format doesn't store length of the uncompressed
+// data. Filters below prefix every compressed block with this length
+// stored as 4 bytes in little endian.
+
+namespace boost { namespace iostreams {
+
+namespace lz4 {
+
+// Level 1 uses the fast compressor, higher levels use the
+// high compression (HC) compressor.
+
+const int default_compression = 1;
+
+const int header_size = 4;
+
+inline void write_header(char *dest, size_t length)
+{
+   for (int i = 0; i < header_size; ++i)
+      dest[i] = (length >> (8 * i)) & 0xff;
+}
+
+inline size_t read_header(const char *src)
+{
+   size_t length = 0;
+
+   for (int i = 0; i < header_size; ++i)
+      length |= (size_t) (unsigned char) src[i] << (8 * i);
+   return length;
+}
+
+}
+
+template< typename Ch, typename Alloc = std::allocator<Ch> >
+class basic_lz4_compressor : public boost::iostreams::aggregate_filter<Ch, Alloc>
+{
+   private:
+
+      typedef boost::iostreams::aggregate_filter<Ch, Alloc> base_type;
+
+   public:
+
+      typedef typename base_type::char_type char_type;
+      typedef typename base_type::category category;
+      typedef std::basic_string<Ch> string_type;
+
+   public:
+
+      basic_lz4_compressor(int level = lz4::default_compression) :
+         level(level)
+      { }
+
+   private:
+
+      typedef typename base_type::vector_type vector_type;
+
+      void do_filter(const vector_type& src, vector_type& dest)
+      {
+         int bound = LZ4_compressBound(src.size());
+         if ((bound == 0) && !src.empty())
+            throw BOOST_IOSTREAMS_FAILURE("lz4: input too large");
+
+         dest.resize(lz4::header_size + bound);
+         lz4::write_header((char *) &dest[0], src.size());
+
+         if (src.empty())
+            return;
+
+         int len;
+         if (level > 1)
+            len = LZ4_compress_HC((const char *) &src[0],
+                                  (char *) &dest[lz4::header_size],
+                                  src.size(), bound, level);
+         else
+            len = LZ4_compress_default((const char *) &src[0],
+                                       (char *) &dest[lz4::header_size],
+                                       src.size(), bound);
+         if (len <= 0)
+            throw BOOST_IOSTREAMS_FAILURE("lz4: compression failed");
+
+         dest.resize(lz4::header_size + len);
+      }
+
+   private:
+
+      int level;
+};
+
+BOOST_IOSTREAMS_PIPABLE(basic_lz4_compressor, 1)
+
+typedef basic_lz4_compressor<char> lz4_compressor;
+
+//
+
+template< typename Ch, typename Alloc = std::allocator<Ch> >
+class basic_lz4_decompressor : public boost::iostreams::aggregate_filter<Ch, Alloc>
+{
+   private:
+
+      typedef boost::iostreams::aggregate_filter<Ch, Alloc> base_type;
+
+   public:
+
+      typedef typename base_type::char_type char_type;
+      typedef typename base_type::category category;
+      typedef std::basic_string<Ch> string_type;
+
+   public:
+
+      basic_lz4_decompressor()
+      { }
+
+   private:
+
+      typedef typename base_type::vector_type vector_type;
+
+      void do_filter(const vector_type& src, vector_type& dest)
+      {
+         if (src.empty())
+         {
+            dest.clear();
+            return;
+         }
+         if (src.size() < (size_t) lz4::header_size)
+            throw BOOST_IOSTREAMS_FAILURE("lz4: truncated block");
+
+         size_t len = lz4::read_header((const char *) &src[0]);
+
+         dest.resize(len);
+         if (len == 0)
+            return;
+
+         int ret = LZ4_decompress_safe((const char *) &src[lz4::header_size],
+                                       (char *) &dest[0],
+                                       src.size() - lz4::header_size, len);
+         if ((ret < 0) || ((size_t) ret != len))
+            throw BOOST_IOSTREAMS_FAILURE("lz4: corrupted block");
+      }
+
+   private:
+
+};
+
+BOOST_IOSTREAMS_PIPABLE(basic_lz4_decompressor, 1)
+
+typedef basic_lz4_decompressor<char> lz4_decompressor;
+
+
+} }
+
+#endif
+
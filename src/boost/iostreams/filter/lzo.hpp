@@ -13,6 +13,7 @@
 	lzo_align_t __LZO_MMODEL var [ ((size) + (sizeof(lzo_align_t) - 1)) / sizeof(lzo_align_t) ]
 
 #include <boost/iostreams/filter/aggregate.hpp>
+#include <boost/iostreams/detail/ios.hpp> // failure.
 
 namespace boost { namespace iostreams {
 
@@ -43,14 +44,15 @@ class basic_lzo_compressor : public boost::iostreams::aggregate_filter<Ch, Alloc
          lzo_uint len = src.size() + src.size() / 16 + 64 + 3;
 
          HEAP_ALLOC(wrkmem, LZO1X_1_MEM_COMPRESS);
-         vector_type tmp(len);
 
-         lzo1x_1_compress((lzo_bytep) &src[0], src.size(),
-                          (lzo_bytep) &tmp[0], &len, wrkmem);
+         // Compress directly to the dest, then cut it to the real size.
 
-         dest.reserve(len);
-         for (unsigned int i = 0; i < len; ++i)
-            dest.push_back(tmp[i]);
+         dest.resize(len);
+
+         lzo1x_1_compress((lzo_bytep) (src.empty() ? NULL : &src[0]), src.size(),
+                          (lzo_bytep) &dest[0], &len, wrkmem);
+
+         dest.resize(len);
       }
 
    private:
@@ -79,7 +81,14 @@ class basic_lzo_decompressor : public boost::iostreams::aggregate_filter<Ch, All
 
    public:
 
-      basic_lzo_decompressor()
+      /**
+       * @param length - size of the decompressed data if known, zero
+       *                 otherwise. Lzo doesn't store it in the compressed
+       *                 data so the decompressor has to guess it if it's
+       *                 not passed here.
+       */
+      basic_lzo_decompressor(size_t length = 0) :
+         length(length)
       { }
 
    private:
@@ -88,31 +97,49 @@ class basic_lzo_decompressor : public boost::iostreams::aggregate_filter<Ch, All
 
       void do_filter(const vector_type& src, vector_type& dest)
       {
-         vector_type tmp;
          lzo_uint len;
+
+         if (src.empty())
+         {
+            dest.clear();
+            return;
+         }
+         if (length > 0)
+         {
+            // Known size, decompress directly to the dest.
+
+            dest.resize(length);
+            len = length;
+
+            if ((lzo1x_decompress_safe((lzo_bytep) &src[0], src.size(),
+                                       (lzo_bytep) &dest[0], &len, NULL) != LZO_E_OK) ||
+                (len != length))
+               throw BOOST_IOSTREAMS_FAILURE("lzo: corrupted block");
+            return;
+         }
+
          int compressionFactor = 10;
 
          while (true)
          {
              len = src.size() * compressionFactor;
-             tmp.assign(len, 0);
+             dest.resize(len);
 
              if (lzo1x_decompress_safe((lzo_bytep) &src[0], src.size(),
-                                       (lzo_bytep) &tmp[0], &len, NULL) == LZO_E_OUTPUT_OVERRUN)
+                                       (lzo_bytep) &dest[0], &len, NULL) == LZO_E_OUTPUT_OVERRUN)
              {
                 compressionFactor *= 2;
                 continue;
              }
              break;
          }
-
-         dest.assign(len, 0);
-         for (unsigned int i = 0; i < len; ++i)
-            dest[i] = tmp[i];
+         dest.resize(len);
       }
 
    private:
 
+      size_t length;
+
 };
 
 BOOST_IOSTREAMS_PIPABLE(basic_lzo_decompressor, 1)
@@ -0,0 +1,129 @@
+// (C) Copyright Milan Svoboda 2009.
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt.)
+
+// See http://www.boost.org/libs/iostreams for documentation.
+
+#ifndef ZSTD_FILTER_HPP
+#define ZSTD_FILTER_HPP
+
+#include <zstd.h>
+
+#include <boost/iostreams/filter/aggregate.hpp>
+#include <boost/iostreams/detail/ios.hpp> // failure.
+
+namespace boost { namespace iostreams {
+
+namespace zstd {
+
+const int default_compression = 3;
+
+}
+
+template< typename Ch, typename Alloc = std::allocator<Ch> >
+class basic_zstd_compressor : public boost::iostreams::aggregate_filter<Ch, Alloc>
+{
+   private:
+
+      typedef boost::iostreams::aggregate_filter<Ch, Alloc> base_type;
+
+   public:
+
+      typedef typename base_type::char_type char_type;
+      typedef typename base_type::category category;
+      typedef std::basic_string<Ch> string_type;
+
+   public:
+
+      basic_zstd_compressor(int level = zstd::default_compression) :
+         level(level)
+      { }
+
+   private:
+
+      typedef typename base_type::vector_type vector_type;
+
+      void do_filter(const vector_type& src, vector_type& dest)
+      {
+         dest.resize(ZSTD_compressBound(src.size()));
+
+         // Whole block is compressed as a single frame, the frame
+         // header holds size of the uncompressed data.
+
+         size_t len = ZSTD_compress(&dest[0], dest.size(),
+                                    src.empty() ? NULL : &src[0], src.size(),
+                                    level);
+         if (ZSTD_isError(len))
+            throw BOOST_IOSTREAMS_FAILURE(ZSTD_getErrorName(len));
+
+         dest.resize(len);
+      }
+
+   private:
+
+      int level;
+};
+
+BOOST_IOSTREAMS_PIPABLE(basic_zstd_compressor, 1)
+
+typedef basic_zstd_compressor<char> zstd_compressor;
+
+//
+
+template< typename Ch, typename Alloc = std::allocator<Ch> >
+class basic_zstd_decompressor : public boost::iostreams::aggregate_filter<Ch, Alloc>
+{
+   private:
+
+      typedef boost::iostreams::aggregate_filter<Ch, Alloc> base_type;
+
+   public:
+
+      typedef typename base_type::char_type char_type;
+      typedef typename base_type::category category;
+      typedef std::basic_string<Ch> string_type;
+
+   public:
+
+      basic_zstd_decompressor()
+      { }
+
+   private:
+
+      typedef typename base_type::vector_type vector_type;
+
+      void do_filter(const vector_type& src, vector_type& dest)
+      {
+         if (src.empty())
+         {
+            dest.clear();
+            return;
+         }
+
+         unsigned long long len = ZSTD_getFrameContentSize(&src[0], src.size());
+         if ((len == ZSTD_CONTENTSIZE_ERROR) || (len == ZSTD_CONTENTSIZE_UNKNOWN))
+            throw BOOST_IOSTREAMS_FAILURE("zstd: invalid frame");
+
+         dest.resize(len);
+
+         size_t ret = ZSTD_decompress(dest.empty() ? NULL : &dest[0], dest.size(),
+                                      &src[0], src.size());
+         if (ZSTD_isError(ret))
+            throw BOOST_IOSTREAMS_FAILURE(ZSTD_getErrorName(ret));
+         if (ret != len)
+            throw BOOST_IOSTREAMS_FAILURE("zstd: truncated frame");
+      }
+
+   private:
+
+};
+
+BOOST_IOSTREAMS_PIPABLE(basic_zstd_decompressor, 1)
+
+typedef basic_zstd_decompressor<char> zstd_decompressor;
+
+
+} }
+
+#endif
+
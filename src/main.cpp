@@ -28,6 +28,9 @@
 #include "CompressedMagic.hpp"
 #include "FuseCompress.hpp"
 #include "CompressionType.hpp"
+#include "BlockCache.hpp"
+#include "Defragmenter.hpp"
+#include "WriteBack.hpp"
 
 #include <boost/version.hpp>
 #if BOOST_VERSION >= 105600
@@ -52,6 +55,7 @@ using namespace std;
 namespace po = boost::program_options;
 
 bool            g_DebugMode;
+unsigned int    g_Threads;
 unsigned int	g_BufferedMemorySize;
 CompressedMagic g_CompressedMagic;
 CompressionType g_CompressionType;
@@ -59,6 +63,15 @@ std::string     g_dirLower;
 std::string     g_dirMount;
 rlog::RLog     *g_RLog;
 
+extern BlockCache   g_BlockCache;
+extern Defragmenter g_Defragmenter;
+extern WriteBack    g_WriteBack;
+extern unsigned int g_ReadAhead;
+extern unsigned int g_FrameLength;
+extern unsigned int g_DefragmentRatio;
+extern unsigned int g_DefragmentMinimum;
+extern bool         g_AlignBlocks;
+
 static void init_log(void)
 {
 	g_RLog = new rlog::RLog("FuseCompress", g_DebugMode ? LOG_DEBUG : LOG_INFO, g_DebugMode);
@@ -86,6 +99,14 @@ int main(int argc, char **argv)
 	g_BufferedMemorySize = 100;
 	g_DebugMode = false;
 
+	unsigned int cacheSize = 16;
+	unsigned int defragmentMinimum = 4;
+	unsigned int defragmentRate = 8;
+	unsigned int writeBackLimit = 64;
+
+	g_ReadAhead = 2;
+	g_Threads = 0;
+
 	string compressorName;
 	string commandLineOptions;
 
@@ -95,11 +116,43 @@ int main(int argc, char **argv)
 	po::options_description desc("Usage: " PACKAGE " [options] dir_lower dir_mount\n" "\nAllowed options");
 	desc.add_options()
 		("options,o", po::value<string>(&commandLineOptions),
-				"fc_c:arg          - compression method\n"
-				"                    (lzo/bzip2/zlib/lzma)\n"
+				"fc_c:arg[:level]  - compression method\n"
+				"                    (lzo/bzip2/zlib/lzma/zstd/lz4)\n"
+				"                    and optional compression level\n"
 				"                    (default: zlib)\n"
 				"fc_b:arg          - size of blocks in kilobytes\n"
 				"                    (default: 100)\n"
+				"fc_cache:arg      - size of cache of decompressed\n"
+				"                    blocks in megabytes, 0 disables\n"
+				"                    the cache (default: 16)\n"
+				"fc_ra:arg         - number of blocks decompressed in\n"
+				"                    advance when a file is read\n"
+				"                    sequentially, 0 disables the\n"
+				"                    read-ahead (default: 2)\n"
+				"fc_align          - store whole blocks aligned to\n"
+				"                    multiples of their size, partial\n"
+				"                    overwrites rewrite whole blocks\n"
+				"fc_frame:arg      - size of independently compressed\n"
+				"                    frames of blocks in kilobytes,\n"
+				"                    0 disables framing (default: 0)\n"
+				"fc_threads:arg    - number of threads that compress\n"
+				"                    and read-ahead blocks, 0 means\n"
+				"                    number of CPUs (default: 0)\n"
+				"fc_defrag:arg     - percentage by which a compressed\n"
+				"                    file may be bigger than the\n"
+				"                    uncompressed one before it's\n"
+				"                    defragmented, 0 disables the\n"
+				"                    defragmentation (default: 20)\n"
+				"fc_defrag_min:arg - size in kilobytes a compressed\n"
+				"                    file may reach before it's\n"
+				"                    defragmented (default: 4)\n"
+				"fc_defrag_rate:arg - megabytes per second processed\n"
+				"                    by the background defragmentation,\n"
+				"                    0 means no limit (default: 8)\n"
+				"fc_wb:arg         - megabytes of written data all\n"
+				"                    files may cache before it's\n"
+				"                    compressed in the background,\n"
+				"                    0 means no limit (default: 64)\n"
 				"fc_d              - run in debug mode\n"
 				"fc_ma:\"arg1;arg2\" - files with passed mime types to be\n"
 				"                    always not compressed\n"
@@ -160,6 +213,8 @@ int main(int argc, char **argv)
 						exit(EXIT_FAILURE);
 					}
 					compressorName = *value;
+					if (++value != tokens.end())
+						compressorName += ":" + *value;
 				}
 				if (*key == "fc_b")
 				{
@@ -170,6 +225,82 @@ int main(int argc, char **argv)
 					}
 					g_BufferedMemorySize = boost::lexical_cast<unsigned int>(*value);
 				}
+				if (*key == "fc_align")
+				{
+					g_AlignBlocks = true;
+				}
+				if (*key == "fc_cache")
+				{
+					if (value == tokens.end())
+					{
+						std::cerr << "Cache size not set!" << std::endl;
+						exit(EXIT_FAILURE);
+					}
+					cacheSize = boost::lexical_cast<unsigned int>(*value);
+				}
+				if (*key == "fc_ra")
+				{
+					if (value == tokens.end())
+					{
+						std::cerr << "Number of read-ahead blocks not set!" << std::endl;
+						exit(EXIT_FAILURE);
+					}
+					g_ReadAhead = boost::lexical_cast<unsigned int>(*value);
+				}
+				if (*key == "fc_frame")
+				{
+					if (value == tokens.end())
+					{
+						std::cerr << "Frame size not set!" << std::endl;
+						exit(EXIT_FAILURE);
+					}
+					g_FrameLength = boost::lexical_cast<unsigned int>(*value);
+				}
+				if (*key == "fc_threads")
+				{
+					if (value == tokens.end())
+					{
+						std::cerr << "Number of threads not set!" << std::endl;
+						exit(EXIT_FAILURE);
+					}
+					g_Threads = boost::lexical_cast<unsigned int>(*value);
+				}
+				if (*key == "fc_defrag")
+				{
+					if (value == tokens.end())
+					{
+						std::cerr << "Defragmentation ratio not set!" << std::endl;
+						exit(EXIT_FAILURE);
+					}
+					g_DefragmentRatio = boost::lexical_cast<unsigned int>(*value);
+				}
+				if (*key == "fc_defrag_min")
+				{
+					if (value == tokens.end())
+					{
+						std::cerr << "Defragmentation minimum not set!" << std::endl;
+						exit(EXIT_FAILURE);
+					}
+					defragmentMinimum = boost::lexical_cast<unsigned int>(*value);
+				}
+				if (*key == "fc_defrag_rate")
+				{
+					if (value == tokens.end())
+					{
+						std::cerr << "Defragmentation rate not set!" << std::endl;
+						exit(EXIT_FAILURE);
+					}
+					defragmentRate = boost::lexical_cast<unsigned int>(*value);
+				}
+				if (*key == "fc_wb")
+				{
+					if (value == tokens.end())
+					{
+						std::cerr << "Write-back limit not set!" << std::endl;
+						exit(EXIT_FAILURE);
+					}
+					writeBackLimit = boost::lexical_cast<unsigned int>(*value);
+				}
 				if (*key == "fc_d")
 				{
 					fuseOptions.push_back("-f");
@@ -221,6 +352,12 @@ int main(int argc, char **argv)
 	}
 
 	g_BufferedMemorySize *= 1024;
+	g_FrameLength *= 1024;
+	g_DefragmentMinimum = defragmentMinimum * 1024;
+
+	g_BlockCache.setLimit((size_t) cacheSize * 1024 * 1024);
+	g_Defragmenter.setRate((size_t) defragmentRate * 1024 * 1024);
+	g_WriteBack.setLimit((size_t) writeBackLimit * 1024 * 1024);
 	
 	// Set up default options for fuse.
 	// 
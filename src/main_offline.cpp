@@ -54,6 +54,7 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <algorithm>
 
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
@@ -155,28 +156,87 @@ bool copy(const char *i, const char *o, const struct stat *i_st, const struct st
 
 	rInfo(" Processing");
 
-	for (off_t off = 0; off < st.st_size; off += g_BufferedMemorySize)
+	if (!g_RawOutput && input.isCompressed() && output.isCompressed())
 	{
-		if (g_BreakFlag)
+		// Blocks already compressed by the requested method
+		// are copied without recompression.
+
+		if (input.copyTo(output) == -1)
 		{
-			rWarning("Interrupted when processing file (%s)", i);
-			rWarning("File is left untouched");
+			rError("Copy failed! (%s)", strerror(errno));
 			input.release(i);
 			output.release(o);
 			return false;
 		}
-		off_t r = input.read(buffer.get(), g_BufferedMemorySize, off);
-		if (r == -1)
+		if (g_BreakFlag)
 		{
-			rError("Read failed! (offset: %lld, size: %lld)", (unsigned long long) off ,(unsigned long long) g_BufferedMemorySize);
+			rWarning("Interrupted when processing file (%s)", i);
+			rWarning("File is left untouched");
 			input.release(i);
 			output.release(o);
 			return false;
 		}
-		off_t rr = output.write(buffer.get(), r, off);
-		if (rr != r)
+	}
+	else
+	{
+		off_t off = 0;
+
+		while (off < st.st_size)
+		{
+			if (g_BreakFlag)
+			{
+				rWarning("Interrupted when processing file (%s)", i);
+				rWarning("File is left untouched");
+				input.release(i);
+				output.release(o);
+				return false;
+			}
+			// Holes of the input file are skipped, the output
+			// file stays sparse.
+
+			off_t data = input.lseek(off, SEEK_DATA);
+			off_t hole = st.st_size;
+
+			if (data == -1)
+			{
+				if (errno == ENXIO)
+					break;
+				data = off;	// Holes are not supported.
+			}
+			else
+				hole = input.lseek(data, SEEK_HOLE);
+			if ((hole == -1) || (hole > st.st_size))
+				hole = st.st_size;
+			if (data >= hole)
+				break;
+			off = data;
+
+			size_t size = std::min((off_t) g_BufferedMemorySize, hole - off);
+
+			off_t r = input.read(buffer.get(), size, off);
+			if (r <= 0)
+			{
+				rError("Read failed! (offset: %lld, size: %lld)", (unsigned long long) off ,(unsigned long long) size);
+				input.release(i);
+				output.release(o);
+				return false;
+			}
+			off_t rr = output.write(buffer.get(), r, off);
+			if (rr != r)
+			{
+				rError("Write failed! (offset: %lld, size: %lld)", (unsigned long long) off , (unsigned long long) r);
+				input.release(i);
+				output.release(o);
+				return false;
+			}
+			off += r;
+		}
+
+		// The file may end with a hole.
+
+		if (output.truncate(o, st.st_size) == -1)
 		{
-			rError("Write failed! (offset: %lld, size: %lld)", (unsigned long long) off , (unsigned long long) r);
+			rError("Truncate failed! (size: %lld)", (unsigned long long) st.st_size);
 			input.release(i);
 			output.release(o);
 			return false;
@@ -295,8 +355,9 @@ int main(int argc, char **argv)
 	                                "Allowed options");
 	desc.add_options()
 		("options,o", po::value<string>(&commandLineOptions),
-				"fc_c:arg  - compression method (lzo/bzip2/zlib/lzma)\n"
-				"            (default: gz)\n"
+				"fc_c:arg  - compression method (lzo/bzip2/zlib/lzma/\n"
+				"            zstd/lz4) optionally followed by\n"
+				"            :level (default: gz)\n"
 				"fc_b:arg  - size of blocks in kilobytes\n"
 				"            (default: 100)\n"
 				"fc_d      - run in debug mode\n"
@@ -365,6 +426,8 @@ int main(int argc, char **argv)
 						exit(EXIT_FAILURE);
 					}
 					compressorName = *value;
+					if (++value != tokens.end())
+						compressorName += ":" + *value;
 				}
 				if (*key == "fc_b")
 				{
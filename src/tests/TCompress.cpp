@@ -0,0 +1,157 @@
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/archive/portable_oarchive.hpp>
+
+#include "rlog/rlog.h"
+
+#include "Compress.hpp"
+#include "CompressedMagic.hpp"
+#include "CompressionType.hpp"
+#include "FileHeader.hpp"
+
+bool            g_DebugMode = false;
+unsigned int	g_BufferedMemorySize = 16 * 1024;
+CompressedMagic g_CompressedMagic;
+CompressionType g_CompressionType;
+std::string     g_dirLower;
+std::string     g_dirMount;
+rlog::RLog     *g_RLog = new rlog::RLog("TCompress", getenv("TC_DEBUG") ? LOG_DEBUG : LOG_WARNING, true);
+
+extern unsigned int g_DefragmentRatio;
+
+// Write the `size` bytes of the `ref` at the `offset` to the file and
+// release it, every session stores a record of the index journal.
+//
+static void session(const char *name, const std::vector<char> &ref, off_t offset, size_t size)
+{
+	struct stat st;
+
+	BOOST_REQUIRE(lstat(name, &st) == 0);
+
+	Compress file(&st, name);
+
+	BOOST_REQUIRE(file.open(name, O_RDWR) != -1);
+	BOOST_REQUIRE(file.write(&ref[offset], size, offset) == (ssize_t) size);
+	BOOST_REQUIRE(file.release(name) != -1);
+}
+
+static void check(const char *name, const std::vector<char> &ref)
+{
+	struct stat st;
+
+	BOOST_REQUIRE(lstat(name, &st) == 0);
+
+	Compress file(&st, name);
+
+	BOOST_REQUIRE(file.open(name, O_RDONLY) != -1);
+
+	std::vector<char> buf(ref.size());
+
+	BOOST_CHECK(file.read(&buf[0], buf.size(), 0) == (ssize_t) buf.size());
+	BOOST_CHECK(memcmp(&buf[0], &ref[0], ref.size()) == 0);
+
+	file.release(name);
+}
+
+// Create an empty file with the index compressed by the `type`,
+// the index is otherwise compressed by the default method.
+//
+static void create(const char *name, const CompressionType &type)
+{
+	FileHeader fh;
+
+	fh.type = type;
+
+	std::ofstream file(name, std::ios::binary | std::ios::trunc);
+	eos::portable_oarchive pba(file);
+	pba << fh;
+}
+
+// Number of journal records in the lower file.
+//
+static unsigned int records(const char *name)
+{
+	static const char magic[] = { '\037', '\135', '\211', 'F', 'C', 'J', 'R', '\001' };
+
+	int fd = open(name, O_RDONLY);
+	BOOST_REQUIRE(fd != -1);
+
+	std::vector<char> data(lseek(fd, 0, SEEK_END));
+	BOOST_REQUIRE(pread(fd, &data[0], data.size(), 0) == (ssize_t) data.size());
+	close(fd);
+
+	unsigned int count = 0;
+
+	for (size_t i = 0; i + sizeof(magic) <= data.size(); ++i)
+		if (memcmp(&data[i], magic, sizeof(magic)) == 0)
+			count++;
+	return count;
+}
+
+BOOST_AUTO_TEST_CASE(t1)
+{
+	// Journal records are followed by the Blocks written after them
+	// and by other records. Methods that decompress the whole input
+	// at once (xor, lzo, zstd, lz4) must not read behind a record
+	// of the index compressed by them.
+
+	const char *methods[] = { "xor", "zlib", "lzo", "zstd", "lz4" };
+
+	g_DefragmentRatio = 0;
+
+	char name[] = "/tmp/TCompress.XXXXXX";
+
+	int fd = mkstemp(name);
+	BOOST_REQUIRE(fd != -1);
+	close(fd);
+
+	std::vector<char> ref(64 * g_BufferedMemorySize);
+
+	for (size_t i = 0; i < ref.size(); ++i)
+		ref[i] = (char) (rand() % 16);
+
+	for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m)
+	{
+		if (!g_CompressionType.parseType(methods[m]))
+			continue;
+
+		BOOST_TEST_MESSAGE(methods[m]);
+
+		create(name, g_CompressionType);
+
+		// The whole map first, then small changes stored
+		// as journal records.
+
+		session(name, ref, 0, ref.size());
+
+		for (unsigned int i = 0; i < 4; ++i)
+		{
+			off_t offset = (rand() % 64) * g_BufferedMemorySize + rand() % 100;
+
+			for (size_t j = 0; j < 100; ++j)
+				ref[offset + j] = (char) rand();
+
+			session(name, ref, offset, 100);
+		}
+
+		BOOST_CHECK(records(name) >= 2);
+
+		check(name, ref);
+	}
+
+	unlink(name);
+}
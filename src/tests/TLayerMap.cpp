@@ -1,7 +1,71 @@
 #define BOOST_TEST_MAIN
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+#include <boost/archive/portable_iarchive.hpp>
+#include <boost/archive/portable_oarchive.hpp>
+
 #include "LayerMap.hpp"
+#include "FileUtils.hpp"
+
+// Store the map as a record of the index journal.
+//
+static std::string store(const LayerMap &m)
+{
+	std::ostringstream out;
+	{
+		eos::portable_oarchive pba(out);
+		pba << m;
+	}
+	return out.str();
+}
+
+static void restore(const std::string &record, LayerMap &m)
+{
+	std::istringstream in(record);
+	eos::portable_iarchive pba(in);
+	pba >> m;
+}
+
+// Block of zeros without any data, see Compress::putHole().
+//
+static Block zeroBlock(off_t offset, size_t length)
+{
+	Block block(offset, length);
+
+	block.type.setType(CompressionType::NONE | CompressionType::Zero);
+	return block;
+}
+
+// Both maps must return the same Blocks for all offsets up to the end.
+//
+static void checkSame(const LayerMap &a, const LayerMap &b, off_t end)
+{
+	for (off_t offset = 0; offset <= end; ++offset)
+	{
+		Block ba, bb;
+		off_t la = 0, lb = 0;
+
+		bool ra = a.Get(offset, ba, la);
+		bool rb = b.Get(offset, bb, lb);
+
+		BOOST_CHECK_EQUAL(ra, rb);
+		if (!ra || !rb)
+			continue;
+
+		BOOST_CHECK_EQUAL(ba.offset, bb.offset);
+		BOOST_CHECK_EQUAL(ba.length, bb.length);
+		BOOST_CHECK_EQUAL(ba.level, bb.level);
+		BOOST_CHECK_EQUAL(la, lb);
+	}
+}
 
 BOOST_AUTO_TEST_CASE(t1)
 {
@@ -14,8 +78,8 @@ BOOST_AUTO_TEST_CASE(t1)
 	      |---------|
 	                |---------|
  */
-	m.Put(new Block(15, 10));
-	m.Put(new Block(25, 5));
+	m.Put(Block(15, 10));
+	m.Put(Block(25, 5));
 
 	m.Get(0, block, length);
 
@@ -35,8 +99,8 @@ BOOST_AUTO_TEST_CASE(t2)
 	     |---------|
 	               |---------|
  */
-	m.Put(new Block(5, 10));
-	m.Put(new Block(15, 5));
+	m.Put(Block(5, 10));
+	m.Put(Block(15, 5));
 
 	m.Get(0, block, length);
 
@@ -59,8 +123,8 @@ BOOST_AUTO_TEST_CASE(t3)
 	     |----------|
  */
 
-	m.Put(new Block(0, 10));
-	m.Put(new Block(5, 10));
+	m.Put(Block(0, 10));
+	m.Put(Block(5, 10));
 
 	m.Get(0, block, length);
 
@@ -124,9 +188,9 @@ BOOST_AUTO_TEST_CASE(t4)
 	     |---------|
                            |----|
  */
-	m.Put(new Block(0, 10));
-	m.Put(new Block(5, 10));
-	m.Put(new Block(20, 5));
+	m.Put(Block(0, 10));
+	m.Put(Block(5, 10));
+	m.Put(Block(20, 5));
 
 	m.Get(14, block, length);
 
@@ -155,10 +219,10 @@ BOOST_AUTO_TEST_CASE(t5)
                             |---|
 	         |-------------|
  */
-	m.Put(new Block(0, 10));
-	m.Put(new Block(5, 10));
-	m.Put(new Block(20, 5));
-	m.Put(new Block(10, 14));
+	m.Put(Block(0, 10));
+	m.Put(Block(5, 10));
+	m.Put(Block(20, 5));
+	m.Put(Block(10, 14));
 
 	m.Get(15, block, length);
 
@@ -194,10 +258,10 @@ BOOST_AUTO_TEST_CASE(t6)
 	               |------|
 
  */
-	m.Put(new Block(0, 10));
-	m.Put(new Block(15, 15));
-	m.Put(new Block(5, 14));
-	m.Put(new Block(17, 7));
+	m.Put(Block(0, 10));
+	m.Put(Block(15, 15));
+	m.Put(Block(5, 14));
+	m.Put(Block(17, 7));
 
 	m.Get(3, block, length);
 
@@ -250,26 +314,26 @@ BOOST_AUTO_TEST_CASE(t7)
 	off_t length;
 	bool         r;
 
-	m.Put(new Block(0x2a50, 0x5b0, 0xdf9d), true);                
-	m.Put(new Block(0x3000, 0x1000, 0xdf9e),true);               
-	m.Put(new Block(0x4000, 0x1000, 0xdf9f),true);               
-	m.Put(new Block(0x5000, 0xd4b, 0xdfa0),true);
-	m.Put(new Block(0x52f5, 0xd0b, 0xdff3),true);
-	m.Put(new Block(0x6000, 0x1000, 0xdff4),true);
-	m.Put(new Block(0x6d67, 0x299, 0xdff8),true);
-	m.Put(new Block(0x7000, 0x1000, 0xdff9),true);
-	m.Put(new Block(0x7000, 0x1000, 0xdff5),true);
-	m.Put(new Block(0x7d0f, 0x2f1, 0xe042),true);
-
-	m.Put(new Block(0x8000, 0x1000, 0xe043),true);
-	m.Put(new Block(0x8000, 0x1000, 0xdffa),true);
-	m.Put(new Block(0x8000, 0x1000, 0xdff6),true);
-	m.Put(new Block(0x884f, 0xd9, 0xe07b),true);
-	m.Put(new Block(0x8b04, 0x4fc, 0xe07c),true);
-	m.Put(new Block(0x9000, 0x1000, 0xe07d),true);
-	m.Put(new Block(0x9000, 0x1000, 0xe044),true);
-	m.Put(new Block(0x9000, 0x1000, 0xdffb),true);
-	m.Put(new Block(0x9000, 0x8e7, 0xdff7),true);
+	m.Put(Block(0x2a50, 0x5b0, 0xdf9d), true);                
+	m.Put(Block(0x3000, 0x1000, 0xdf9e),true);               
+	m.Put(Block(0x4000, 0x1000, 0xdf9f),true);               
+	m.Put(Block(0x5000, 0xd4b, 0xdfa0),true);
+	m.Put(Block(0x52f5, 0xd0b, 0xdff3),true);
+	m.Put(Block(0x6000, 0x1000, 0xdff4),true);
+	m.Put(Block(0x6d67, 0x299, 0xdff8),true);
+	m.Put(Block(0x7000, 0x1000, 0xdff9),true);
+	m.Put(Block(0x7000, 0x1000, 0xdff5),true);
+	m.Put(Block(0x7d0f, 0x2f1, 0xe042),true);
+
+	m.Put(Block(0x8000, 0x1000, 0xe043),true);
+	m.Put(Block(0x8000, 0x1000, 0xdffa),true);
+	m.Put(Block(0x8000, 0x1000, 0xdff6),true);
+	m.Put(Block(0x884f, 0xd9, 0xe07b),true);
+	m.Put(Block(0x8b04, 0x4fc, 0xe07c),true);
+	m.Put(Block(0x9000, 0x1000, 0xe07d),true);
+	m.Put(Block(0x9000, 0x1000, 0xe044),true);
+	m.Put(Block(0x9000, 0x1000, 0xdffb),true);
+	m.Put(Block(0x9000, 0x8e7, 0xdff7),true);
 
 	r = m.Get(0x8b00, block, length);
 
@@ -285,30 +349,30 @@ BOOST_AUTO_TEST_CASE(t7)
 	BOOST_CHECK(length == 0x4fc);
 
 
-	m.Put(new Block(0x9d35, 0x172, 0xdfd4),true);
-	m.Put(new Block(0x9d94, 0x26c, 0xe04a),true);
-	m.Put(new Block(0xa000, 0x1000, 0xe07e),true);
-	m.Put(new Block(0xa000, 0x1000, 0xe04b),true);
-	m.Put(new Block(0xa000, 0x1000, 0xe045),true);
-	m.Put(new Block(0xa000, 0xea8, 0xdffc),true);
-	m.Put(new Block(0xb000, 0x1000, 0xe07f),true);
-	m.Put(new Block(0xb000, 0x1000, 0xe04c),true);
-	m.Put(new Block(0xb000, 0x1000, 0xe046),true);
-	m.Put(new Block(0xc000, 0x1000, 0xe080),true);
-	m.Put(new Block(0xc000, 0x1000, 0xe04d),true);
-	m.Put(new Block(0xc000, 0x1000, 0xe047),true);
-	m.Put(new Block(0xd000, 0x1000, 0xe081),true);
-	m.Put(new Block(0xd000, 0x1000, 0xe04e),true);
-	m.Put(new Block(0xd000, 0x1000, 0xe048),true);
-	m.Put(new Block(0xe000, 0x1000, 0xe082),true);
-	m.Put(new Block(0xe000, 0x1000, 0xe04f),true);
-	m.Put(new Block(0xe000, 0x2ca, 0xe049),true);
-	m.Put(new Block(0xf000, 0x1000, 0xe083),true);
-	m.Put(new Block(0xf000, 0x1000, 0xe050),true);
-	m.Put(new Block(0x10000, 0x1000, 0xe084),true);
-	m.Put(new Block(0x10000, 0x1000, 0xe051),true);
-	m.Put(new Block(0x11000, 0x634, 0xe085),true);
-	m.Put(new Block(0x11000, 0xdf6, 0xe052),true);
+	m.Put(Block(0x9d35, 0x172, 0xdfd4),true);
+	m.Put(Block(0x9d94, 0x26c, 0xe04a),true);
+	m.Put(Block(0xa000, 0x1000, 0xe07e),true);
+	m.Put(Block(0xa000, 0x1000, 0xe04b),true);
+	m.Put(Block(0xa000, 0x1000, 0xe045),true);
+	m.Put(Block(0xa000, 0xea8, 0xdffc),true);
+	m.Put(Block(0xb000, 0x1000, 0xe07f),true);
+	m.Put(Block(0xb000, 0x1000, 0xe04c),true);
+	m.Put(Block(0xb000, 0x1000, 0xe046),true);
+	m.Put(Block(0xc000, 0x1000, 0xe080),true);
+	m.Put(Block(0xc000, 0x1000, 0xe04d),true);
+	m.Put(Block(0xc000, 0x1000, 0xe047),true);
+	m.Put(Block(0xd000, 0x1000, 0xe081),true);
+	m.Put(Block(0xd000, 0x1000, 0xe04e),true);
+	m.Put(Block(0xd000, 0x1000, 0xe048),true);
+	m.Put(Block(0xe000, 0x1000, 0xe082),true);
+	m.Put(Block(0xe000, 0x1000, 0xe04f),true);
+	m.Put(Block(0xe000, 0x2ca, 0xe049),true);
+	m.Put(Block(0xf000, 0x1000, 0xe083),true);
+	m.Put(Block(0xf000, 0x1000, 0xe050),true);
+	m.Put(Block(0x10000, 0x1000, 0xe084),true);
+	m.Put(Block(0x10000, 0x1000, 0xe051),true);
+	m.Put(Block(0x11000, 0x634, 0xe085),true);
+	m.Put(Block(0x11000, 0xdf6, 0xe052),true);
 
 	r = m.Get(0x0, block, length);
 
@@ -350,11 +414,11 @@ BOOST_AUTO_TEST_CASE(t8)
 	bool         r;
 
 
-	m.Put(new Block(0x8000, 0x1000, 0x5e433), true);
-	m.Put(new Block(0x8000, 0x1000, 0x5e3fe), true);
-	m.Put(new Block(0x81ce, 0x3bb, 0x5e481), true);
-	m.Put(new Block(0x8aea, 0x516, 0x5e464), true);
-	m.Put(new Block(0x9000, 0x1000, 0x5e465), true);
+	m.Put(Block(0x8000, 0x1000, 0x5e433), true);
+	m.Put(Block(0x8000, 0x1000, 0x5e3fe), true);
+	m.Put(Block(0x81ce, 0x3bb, 0x5e481), true);
+	m.Put(Block(0x8aea, 0x516, 0x5e464), true);
+	m.Put(Block(0x9000, 0x1000, 0x5e465), true);
 
 	r = m.Get(0x8000, block, length);
 
@@ -393,12 +457,12 @@ BOOST_AUTO_TEST_CASE(t9)
 	off_t length;
 	bool         r;
 
-	m.Put(new Block(0x8, 0x12, 0x2e7), true);
-	m.Put(new Block(0x4f, 0x234, 0x345), true);
-	m.Put(new Block(0xbd, 0x805e, 0x368), true);
-	m.Put(new Block(0x24b, 0x38, 0x34d), true);
-	m.Put(new Block(0x1edf, 0x452c, 0x364), true);
-	m.Put(new Block(0x24d9, 0x5c42, 0x365), true);
+	m.Put(Block(0x8, 0x12, 0x2e7), true);
+	m.Put(Block(0x4f, 0x234, 0x345), true);
+	m.Put(Block(0xbd, 0x805e, 0x368), true);
+	m.Put(Block(0x24b, 0x38, 0x34d), true);
+	m.Put(Block(0x1edf, 0x452c, 0x364), true);
+	m.Put(Block(0x24d9, 0x5c42, 0x365), true);
 
 	r = m.Get(0x5000, block, length);
 
@@ -423,15 +487,15 @@ BOOST_AUTO_TEST_CASE(t10)
 	off_t length;
 	bool         r;
 
-	m.Put(new Block(0x25, 0x26, 0x1), true);
-	m.Put(new Block(0x2a3, 0xea1, 0x2), true);
-	m.Put(new Block(0x1144, 0x1502, 0x3), true);
-	m.Put(new Block(0x2646, 0x4bbc, 0x4), true);
-	m.Put(new Block(0x7202, 0x4242, 0x5), true);
-	m.Put(new Block(0xd1c9, 0x8cd8, 0x6), true);
-	m.Put(new Block(0x2c83d, 0x6313, 0x7), true);
-	m.Put(new Block(0x32b50, 0x872d, 0x8), true);
-	m.Put(new Block(0x3ff88c, 0xe00, 0x9), true);
+	m.Put(Block(0x25, 0x26, 0x1), true);
+	m.Put(Block(0x2a3, 0xea1, 0x2), true);
+	m.Put(Block(0x1144, 0x1502, 0x3), true);
+	m.Put(Block(0x2646, 0x4bbc, 0x4), true);
+	m.Put(Block(0x7202, 0x4242, 0x5), true);
+	m.Put(Block(0xd1c9, 0x8cd8, 0x6), true);
+	m.Put(Block(0x2c83d, 0x6313, 0x7), true);
+	m.Put(Block(0x32b50, 0x872d, 0x8), true);
+	m.Put(Block(0x3ff88c, 0xe00, 0x9), true);
 
 	r = m.Get(0xec000, block, length);
 
@@ -448,3 +512,586 @@ BOOST_AUTO_TEST_CASE(t10)
 	BOOST_CHECK(length == 0x0);
 }
 
+BOOST_AUTO_TEST_CASE(t11)
+{
+	LayerMap m;
+
+	Block        block;
+	off_t length;
+/*
+	0    5   10   15  20   25   30
+	     |--------------|
+	          |----|
+	                         |----|
+ */
+	m.Put(Block(5, 15));
+	m.Put(Block(10, 5));
+
+	std::vector<char> data;
+
+	m.saveMapped(data);
+
+	FILE *f = tmpfile();
+	BOOST_REQUIRE(f != NULL);
+	BOOST_REQUIRE(pwrite(fileno(f), &data[0], data.size(), 100) == (ssize_t) data.size());
+
+	LayerMap b;
+
+	b.setBase(boost::shared_ptr<MappedIndex>(new MappedIndex(fileno(f), 100)));
+	fclose(f);
+
+	b.Put(Block(25, 5));
+
+	b.Get(0, block, length);
+
+	BOOST_CHECK(block.offset == 5);
+	BOOST_CHECK(length == 0);
+
+	b.Get(12, block, length);
+
+	BOOST_CHECK(block.offset == 10);
+	BOOST_CHECK(block.length == 5);
+	BOOST_CHECK(length == 3);
+
+	b.Get(15, block, length);
+
+	BOOST_CHECK(block.offset == 5);
+	BOOST_CHECK(length == 5);
+
+	b.Get(22, block, length);
+
+	BOOST_CHECK(block.offset == 25);
+	BOOST_CHECK(length == 0);
+
+	b.Truncate(17);
+
+	b.Get(15, block, length);
+
+	BOOST_CHECK(block.offset == 5);
+	BOOST_CHECK(block.length == 12);
+	BOOST_CHECK(length == 2);
+
+	BOOST_CHECK(b.Get(17, block, length) == false);
+}
+
+BOOST_AUTO_TEST_CASE(t12)
+{
+	LayerMap m;
+
+	m.Put(Block(5, 15));
+	m.Put(Block(10, 5));
+
+	std::vector<char> data;
+
+	m.saveMapped(data);
+
+	// Extent that points behind the Blocks.
+
+	MappedIndex::Header *header = (MappedIndex::Header *) &data[0];
+	MappedIndex::Extent *extent = (MappedIndex::Extent *) (&data[0] +
+		sizeof(MappedIndex::Header) + header->blocks * sizeof(MappedIndex::Record));
+
+	extent->block = header->blocks;
+
+	FILE *f = tmpfile();
+	BOOST_REQUIRE(f != NULL);
+	BOOST_REQUIRE(pwrite(fileno(f), &data[0], data.size(), 0) == (ssize_t) data.size());
+
+	// Records are checked when a lookup reads them, the rest
+	// of the index stays readable.
+
+	LayerMap b;
+
+	b.setBase(boost::shared_ptr<MappedIndex>(new MappedIndex(fileno(f), 0)));
+
+	Block block;
+	off_t length;
+
+	errno = 0;
+	BOOST_CHECK(b.Get(5, block, length) == false);
+	BOOST_CHECK(errno == EIO);
+
+	BOOST_CHECK(b.Get(15, block, length) == true);
+	BOOST_CHECK(block.offset == 5);
+	BOOST_CHECK(length == 5);
+
+	BOOST_CHECK(b.Get(20, block, length) == false);
+	BOOST_CHECK(errno == 0);
+
+	// Only the header is checked when the index is mapped.
+
+	BOOST_REQUIRE(ftruncate(fileno(f), data.size() - 1) == 0);
+	BOOST_CHECK_THROW(MappedIndex(fileno(f), 0), std::ios_base::failure);
+
+	fclose(f);
+}
+
+BOOST_AUTO_TEST_CASE(t13)
+{
+	LayerMap m;
+
+	m.Put(Block(5, 15));
+	m.Put(Block(10, 5));
+	m.Put(Block(25, 5));
+	m.Truncate(27);
+
+	// A record of the whole map reads the same after it's restored.
+
+	LayerMap r;
+
+	restore(store(m), r);
+
+	BOOST_CHECK(r.previous() == 0);
+	BOOST_CHECK(r.size() == m.size());
+	BOOST_CHECK(r.changes() == 0);
+	BOOST_CHECK(r.isModified() == false);
+
+	checkSame(m, r, 35);
+}
+
+BOOST_AUTO_TEST_CASE(t14)
+{
+	LayerMap m;
+
+	Block block;
+	off_t length;
+/*
+	0    5   10   15  20   25   30   35  40   45  50
+	|-------------------|         |-------------------|	whole map
+	          |------------------------|			record 1
+	           truncated at 15 -->           |--------|	record 2
+ */
+	m.Put(Block(0, 20));
+	m.Put(Block(30, 20));
+
+	std::string full = store(m);
+	m.setStored();
+
+	// Journal records hold only the Blocks put since the last
+	// store and the lowest offset the map was truncated to.
+
+	m.setPrevious(100);
+	m.Put(Block(10, 25));
+
+	BOOST_CHECK(m.changes() == 1);
+
+	std::string first = store(m);
+	m.setStored();
+
+	m.setPrevious(200);
+	m.Truncate(15);
+	m.Put(Block(40, 10));
+
+	BOOST_CHECK(m.changes() == 1);
+
+	std::string second = store(m);
+	m.setStored();
+
+	LayerMap j, r1, r2;
+
+	restore(full, j);
+	restore(first, r1);
+	restore(second, r2);
+
+	BOOST_CHECK(j.previous() == 0);
+	BOOST_CHECK(r1.previous() == 100);
+	BOOST_CHECK(r1.size() == 1);
+	BOOST_CHECK(r2.previous() == 200);
+	BOOST_CHECK(r2.size() == 1);
+
+	// Records are replayed in the order they were stored.
+
+	j.Apply(r1);
+
+	j.Get(32, block, length);
+
+	BOOST_CHECK(block.offset == 10);
+	BOOST_CHECK(length == 3);
+
+	j.Apply(r2);
+
+	BOOST_CHECK(j.changes() == 0);
+	BOOST_CHECK(j.isModified() == false);
+
+	// The truncation hides the Block at 30 before the Block
+	// at 40 is put.
+
+	j.Get(20, block, length);
+
+	BOOST_CHECK(block.offset == 40);
+	BOOST_CHECK(length == 0);
+
+	checkSame(m, j, 55);
+}
+
+BOOST_AUTO_TEST_CASE(t15)
+{
+	LayerMap m;
+/*
+	0    5   10   15  20   25   30
+	|-------------------|			mapped whole map
+	          |-------------------|
+	       truncated at 12 -->|----|	record
+ */
+	m.Put(Block(0, 20));
+	m.Put(Block(10, 20));
+
+	std::vector<char> data;
+
+	m.saveMapped(data);
+	m.setStored();
+
+	FILE *f = tmpfile();
+	BOOST_REQUIRE(f != NULL);
+	BOOST_REQUIRE(pwrite(fileno(f), &data[0], data.size(), 0) == (ssize_t) data.size());
+
+	LayerMap j;
+
+	j.setBase(boost::shared_ptr<MappedIndex>(new MappedIndex(fileno(f), 0)));
+	fclose(f);
+
+	// The truncation stored in the record cuts the Blocks
+	// of the base.
+
+	m.setPrevious(100);
+	m.Truncate(12);
+	m.Put(Block(25, 5));
+
+	LayerMap r;
+
+	restore(store(m), r);
+	j.Apply(r);
+
+	checkSame(m, j, 35);
+}
+
+BOOST_AUTO_TEST_CASE(t16)
+{
+	LayerMap m;
+
+	for (int i = 0; i < 8; ++i)
+		m.Put(Block(i * 10, 10));
+	m.setStored();
+
+	BOOST_CHECK(m.isJournalFull(0, 0) == false);
+	BOOST_CHECK(m.isJournalFull(LayerMap::MaxJournalLength - 1, 4) == false);
+
+	// Too many records.
+
+	BOOST_CHECK(m.isJournalFull(LayerMap::MaxJournalLength, 0) == true);
+
+	// More Blocks in the journal than a half of the map.
+
+	BOOST_CHECK(m.isJournalFull(1, 5) == true);
+
+	// Blocks not stored yet count as well.
+
+	m.Put(Block(0, 10));
+
+	BOOST_CHECK(m.isJournalFull(1, 3) == false);
+	BOOST_CHECK(m.isJournalFull(1, 4) == true);
+}
+
+BOOST_AUTO_TEST_CASE(t17)
+{
+	LayerMap m;
+
+	Block block;
+	off_t length;
+
+	// Random Puts and Truncates compared with a reference that
+	// keeps the level of the Block visible at every byte.
+
+	const off_t Size = 256;
+
+	std::vector<unsigned int> owner(Size, 0);
+
+	srand(1);
+
+	for (unsigned int i = 1; i <= 2000; ++i)
+	{
+		if (rand() % 16 == 0)
+		{
+			off_t end = rand() % Size;
+
+			m.Truncate(end);
+			std::fill(owner.begin() + end, owner.end(), 0);
+		}
+		else
+		{
+			off_t offset = rand() % Size;
+			off_t len = 1 + rand() % (Size - offset);
+
+			m.Put(Block(offset, len, i), true);
+			std::fill(owner.begin() + offset, owner.begin() + offset + len, i);
+		}
+
+		for (off_t offset = 0; offset <= Size; ++offset)
+		{
+			// The Block that covers the offset or the first
+			// one behind it and the length of its run.
+
+			off_t start = offset;
+			while ((start < Size) && (owner[start] == 0))
+				start++;
+
+			off_t end = start;
+			while ((end < Size) && (owner[end] == owner[start]))
+				end++;
+
+			bool r = m.Get(offset, block, length);
+
+			BOOST_REQUIRE_EQUAL(r, start < Size);
+			if (!r)
+				continue;
+
+			BOOST_REQUIRE_EQUAL(block.level, owner[start]);
+			BOOST_REQUIRE(block.offset <= start);
+			BOOST_REQUIRE(block.offset + (off_t) block.length >= end);
+			BOOST_REQUIRE_EQUAL(length, (start == offset) ? end - offset : 0);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(t18)
+{
+	LayerMap m;
+
+	Block block;
+	off_t length;
+/*
+	0    5   10   15  20   25   30
+	|-------------------|		zlib
+	     |---------|		zeros
+	               |---------|	zeros
+ */
+	CompressionType zlib;
+
+	zlib.setType(CompressionType::ZLIB);
+
+	Block data(0, 20);
+
+	data.type = zlib;
+	data.clength = 7;
+
+	m.Put(data);
+	m.Put(zeroBlock(5, 10));
+	m.Put(zeroBlock(15, 10));
+
+	// Holes hide the data below them. Readers fill them with zeros,
+	// copies skip them, both need the extent of the hole.
+
+	m.Get(3, block, length);
+
+	BOOST_CHECK(block.type.isZero() == false);
+	BOOST_CHECK(length == 2);
+
+	m.Get(7, block, length);
+
+	BOOST_CHECK(block.type.isZero() == true);
+	BOOST_CHECK(block.offset == 5);
+	BOOST_CHECK(block.clength == 0);
+	BOOST_CHECK(length == 8);
+
+	m.Get(15, block, length);
+
+	BOOST_CHECK(block.type.isZero() == true);
+	BOOST_CHECK(block.offset == 15);
+	BOOST_CHECK(length == 10);
+
+	// Holes don't prevent a file from being copied by Blocks.
+
+	BOOST_CHECK(m.isCompressedOnlyWith(zlib) == true);
+
+	// Framed Blocks are compressed by the same method.
+
+	Block framed(25, 5);
+
+	framed.type = zlib;
+	framed.type.setFramed(true);
+	framed.clength = 4;
+	framed.flength = 4;
+	framed.frames.push_back(0);
+	framed.frames.push_back(2);
+	m.Put(framed);
+
+	BOOST_CHECK(m.isCompressedOnlyWith(zlib) == true);
+
+	// The same Blocks in a mapped index.
+
+	std::vector<char> index;
+
+	m.saveMapped(index);
+
+	FILE *f = tmpfile();
+	BOOST_REQUIRE(f != NULL);
+	BOOST_REQUIRE(pwrite(fileno(f), &index[0], index.size(), 0) == (ssize_t) index.size());
+
+	LayerMap b;
+
+	b.setBase(boost::shared_ptr<MappedIndex>(new MappedIndex(fileno(f), 0)));
+
+	BOOST_CHECK(b.isCompressedOnlyWith(zlib) == true);
+
+	fclose(f);
+
+	Block other(20, 5);
+
+	other.type.setType(CompressionType::LZMA);
+	m.Put(other);
+
+	BOOST_CHECK(m.isCompressedOnlyWith(zlib) == false);
+}
+
+BOOST_AUTO_TEST_CASE(t19)
+{
+	LayerMap m;
+
+	Block block;
+	off_t length;
+
+	m.Put(Block(0, 20));
+	m.Put(zeroBlock(5, 10));
+
+	// Holes stay holes in the mapped index...
+
+	std::vector<char> data;
+
+	m.saveMapped(data);
+	m.setStored();
+
+	FILE *f = tmpfile();
+	BOOST_REQUIRE(f != NULL);
+	BOOST_REQUIRE(pwrite(fileno(f), &data[0], data.size(), 0) == (ssize_t) data.size());
+
+	LayerMap j;
+
+	j.setBase(boost::shared_ptr<MappedIndex>(new MappedIndex(fileno(f), 0)));
+	fclose(f);
+
+	j.Get(7, block, length);
+
+	BOOST_CHECK(block.type.isZero() == true);
+	BOOST_CHECK(length == 8);
+
+	// ...and in the records of the journal.
+
+	m.setPrevious(100);
+	m.Put(zeroBlock(18, 10));
+
+	LayerMap r;
+
+	restore(store(m), r);
+	j.Apply(r);
+
+	j.Get(20, block, length);
+
+	BOOST_CHECK(block.type.isZero() == true);
+	BOOST_CHECK(block.offset == 18);
+	BOOST_CHECK(length == 8);
+
+	checkSame(m, j, 30);
+}
+
+BOOST_AUTO_TEST_CASE(t20)
+{
+	// Holes are whole chunks of Minimum bytes aligned to the
+	// offsets of the file, see Compress::writeSparse().
+
+	const size_t Minimum = 64 * 1024;
+
+	std::vector<char> buf(4 * Minimum, 'x');
+
+	size_t start;
+
+	// A chunk of zeros.
+
+	std::fill(buf.begin() + Minimum, buf.begin() + 2 * Minimum, 0);
+
+	BOOST_CHECK(FileUtils::findHole(&buf[0], buf.size(), 0, Minimum, start) == Minimum);
+	BOOST_CHECK(start == Minimum);
+
+	// The same zeros, but not aligned to the chunks of the file.
+
+	BOOST_CHECK(FileUtils::findHole(&buf[0], buf.size(), 1, Minimum, start) == 0);
+
+	// One byte short of a chunk.
+
+	buf[Minimum] = 'x';
+
+	BOOST_CHECK(FileUtils::findHole(&buf[0], buf.size(), 0, Minimum, start) == 0);
+
+	// Zeros that cover a chunk and a bit: the zeros in front of
+	// the chunk are left with the data, the ones behind it
+	// belong to the hole.
+
+	std::fill(buf.begin() + Minimum, buf.begin() + 3 * Minimum + 10, 0);
+
+	BOOST_CHECK(FileUtils::findHole(&buf[0], buf.size(), 100, Minimum, start) == Minimum + 110);
+	BOOST_CHECK(start == 2 * Minimum - 100);
+
+	// Zeros at the end of the buffer that don't fill the last chunk.
+
+	std::fill(buf.begin(), buf.end(), 'x');
+	std::fill(buf.begin() + 3 * Minimum + 1, buf.end(), 0);
+
+	BOOST_CHECK(FileUtils::findHole(&buf[0], buf.size(), 0, Minimum, start) == 0);
+
+	// The whole buffer is a hole, the run goes on into the
+	// last chunk that isn't whole.
+
+	std::fill(buf.begin(), buf.end(), 0);
+
+	BOOST_CHECK(FileUtils::findHole(&buf[0], Minimum + 100, 0, Minimum, start) == Minimum + 100);
+	BOOST_CHECK(start == 0);
+
+	// Buffers shorter than a chunk are never holes.
+
+	BOOST_CHECK(FileUtils::findHole(&buf[0], Minimum - 1, 0, Minimum, start) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(t21)
+{
+	// The scans compare single bytes up to an aligned word and
+	// whole words or vector blocks then, every size and alignment
+	// of the buffer takes a different path through them.
+
+	std::vector<char> storage(300 + 32 + 128, 0);
+
+	unsigned int failures = 0;
+
+	for (size_t align = 0; align < 32; ++align)
+	{
+		// The buffer starts at the `align` of a 32 bytes boundary.
+
+		char *buf = &storage[0] + (32 - (uintptr_t) &storage[0] % 32) % 32 + align;
+
+		for (size_t size = 0; size <= 300; ++size)
+		{
+			// pos == size leaves the buffer zero only.
+
+			for (size_t pos = 0; pos <= size; ++pos)
+			{
+				if (pos < size)
+					buf[pos] = 1;
+
+				size_t prefix = pos;
+				size_t suffix = (pos < size) ? size - pos - 1 : size;
+
+				if ((FileUtils::zeroPrefix(buf, size) != prefix) ||
+				    (FileUtils::zeroPrefixWords(buf, size) != prefix) ||
+				    (FileUtils::zeroSuffix(buf, size) != suffix) ||
+				    (FileUtils::zeroSuffixWords(buf, size) != suffix) ||
+				    (FileUtils::isZeroOnly(buf, size) != (pos == size)))
+				{
+					if (failures++ < 10)
+						BOOST_ERROR("align " << align << ", size " << size << ", pos " << pos);
+				}
+
+				if (pos < size)
+					buf[pos] = 0;
+			}
+		}
+	}
+	BOOST_CHECK(failures == 0);
+}